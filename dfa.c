@@ -0,0 +1,1026 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "util.h"
+#include "nfa.h"
+#include "dfa.h"
+
+// Subset construction over the compact form of the NFAs. Each DFA state stands
+// for the set of NFA states that nfa_compact_step would produce, so the DFA
+// accepts exactly what simulate() does; the sets are sorted so they can be
+// hashed and compared.
+
+struct dfa_set {
+	int32_t *states;
+	int32_t num_states;
+	uint64_t hash;
+};
+
+struct dfa_builder {
+	struct dfa *dfa;
+	const struct nfa_compact *nfa;
+	const int32_t *labels;
+	int32_t unknown;       /* initial value of new transitions */
+	struct dfa_set *sets;  /* indexed by DFA state */
+	ptrdiff_t capacity;    /* of sets, dfa->trans and dfa->accept */
+	int32_t *table;        /* open-addressed, DFA state + 1, or 0 if empty */
+	ptrdiff_t table_size;
+	size_t bytes;          /* used by the states, not counting spare capacity */
+};
+
+static uint64_t
+hash_states(const int32_t *states, int32_t n)
+{
+	uint64_t h = 14695981039346656037ull;
+	for (int32_t i = 0; i < n; i++) {
+		h ^= (uint64_t)states[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static int
+same_set(struct dfa_set *set, const int32_t *states, int32_t n, uint64_t hash)
+{
+	return set->hash == hash && set->num_states == n &&
+	    memcmp(set->states, states, n * sizeof *states) == 0;
+}
+
+static size_t
+state_bytes(int32_t n)
+{
+	return 257 * sizeof(int32_t) + sizeof(struct dfa_set) + n * sizeof(int32_t);
+}
+
+static void
+builder_init(struct dfa_builder *b, const struct nfa_compact *nfa, const int32_t *labels, int32_t unknown)
+{
+	struct dfa *dfa = emalloc(sizeof *dfa);
+
+	dfa->num_states = 0;
+	dfa->start = DFA_DEAD;
+	dfa->loop = NULL;
+	dfa->loops = NULL;
+	dfa->num_loops = 0;
+	b->dfa = dfa;
+	b->nfa = nfa;
+	b->labels = labels;
+	b->unknown = unknown;
+	b->capacity = 16;
+	b->sets = emalloc(b->capacity * sizeof *b->sets);
+	dfa->trans = emalloc(b->capacity * 256 * sizeof *dfa->trans);
+	dfa->accept = emalloc(b->capacity * sizeof *dfa->accept);
+	b->table_size = 64;
+	b->table = emalloc(b->table_size * sizeof *b->table);
+	memset(b->table, 0, b->table_size * sizeof *b->table);
+	b->bytes = 0;
+}
+
+/* Frees everything but the DFA itself. */
+static void
+builder_finish(struct dfa_builder *b)
+{
+	for (int32_t d = 0; d < b->dfa->num_states; d++)
+		free(b->sets[d].states);
+	free(b->sets);
+	free(b->table);
+}
+
+static void
+builder_rehash(struct dfa_builder *b, ptrdiff_t size)
+{
+	int32_t *table = emalloc(size * sizeof *table);
+
+	memset(table, 0, size * sizeof *table);
+	for (int32_t d = 1; d < b->dfa->num_states; d++) {
+		ptrdiff_t j = b->sets[d].hash & (size - 1);
+		while (table[j] != 0)
+			j = (j + 1) & (size - 1);
+		table[j] = d + 1;
+	}
+
+	free(b->table);
+	b->table = table;
+	b->table_size = size;
+}
+
+static int32_t
+builder_add(struct dfa_builder *b, const int32_t *states, int32_t n, uint64_t hash)
+{
+	struct dfa *dfa = b->dfa;
+	int32_t d = dfa->num_states;
+	int32_t first = -1;
+
+	if (d >= b->capacity) {
+		b->capacity *= 2;
+		b->sets = erealloc(b->sets, b->capacity * sizeof *b->sets);
+		dfa->trans = erealloc(dfa->trans, b->capacity * 256 * sizeof *dfa->trans);
+		dfa->accept = erealloc(dfa->accept, b->capacity * sizeof *dfa->accept);
+	}
+
+	b->sets[d].states = emalloc((n ? n : 1) * sizeof *states);
+	if (n > 0)
+		memcpy(b->sets[d].states, states, n * sizeof *states);
+	b->sets[d].num_states = n;
+	b->sets[d].hash = hash;
+	for (int c = 0; c < 256; c++)
+		dfa->trans[d * 256 + c] = d == DFA_DEAD ? DFA_DEAD : b->unknown;
+	for (int32_t i = 0; i < n; i++) {
+		int32_t k = b->nfa->accepts[states[i]];
+		if (k >= 0 && (first < 0 || k < first))
+			first = k;
+	}
+	dfa->accept[d] = first >= 0 ? b->labels[first] : -1;
+	dfa->num_states++;
+	b->bytes += state_bytes(n);
+
+	if (2 * dfa->num_states > b->table_size)
+		builder_rehash(b, 2 * b->table_size);
+
+	return d;
+}
+
+/* Sorts the set and returns its DFA state, or -1 if it has none yet. */
+static int32_t
+builder_find(struct dfa_builder *b, struct nfa_indexset *set, uint64_t *hash)
+{
+	ptrdiff_t j;
+	int32_t d;
+
+	nfa_indexset_sort(set);
+	*hash = hash_states(set->dense, set->num);
+
+	for (j = *hash & (b->table_size - 1); b->table[j] != 0; j = (j + 1) & (b->table_size - 1)) {
+		d = b->table[j] - 1;
+		if (same_set(&b->sets[d], set->dense, set->num, *hash))
+			return d;
+	}
+	return -1;
+}
+
+/* Adds a state for a set builder_find did not find. */
+static int32_t
+builder_insert(struct dfa_builder *b, struct nfa_indexset *set, uint64_t hash)
+{
+	int32_t d = builder_add(b, set->dense, set->num, hash);
+	ptrdiff_t j = hash & (b->table_size - 1);
+
+	while (b->table[j] != 0)
+		j = (j + 1) & (b->table_size - 1);
+	b->table[j] = d + 1;
+	return d;
+}
+
+/* Returns the DFA state for the set, creating it if it is new. */
+static int32_t
+builder_intern(struct dfa_builder *b, struct nfa_indexset *set)
+{
+	uint64_t hash;
+	int32_t d;
+
+	if (set->num == 0)
+		return DFA_DEAD;
+	if ((d = builder_find(b, set, &hash)) >= 0)
+		return d;
+	return builder_insert(b, set, hash);
+}
+
+/* Adds the dead state and the start state, the closure of every initial state. */
+static void
+builder_start(struct dfa_builder *b, struct nfa_indexset *set)
+{
+	builder_add(b, NULL, 0, 0);
+
+	set->num = 0;
+	for (int i = 0; i < b->nfa->num_graphs; i++)
+		if (!nfa_indexset_contains(set, b->nfa->initial[i]))
+			nfa_compact_pushclosure(b->nfa, set, b->nfa->initial[i]);
+	b->dfa->start = builder_intern(b, set);
+}
+
+/* Leaves the set reached from state d on c in set. */
+static void
+builder_move(struct dfa_builder *b, struct nfa_indexset *set, int32_t d, int c)
+{
+	struct nfa_indexset from = {b->sets[d].states, NULL, b->sets[d].num_states};
+
+	set->num = 0;
+	nfa_compact_step(b->nfa, &from, set, c);
+}
+
+/*
+ * Builds one DFA recognising the union of graphs[0..n). A state accepts
+ * labels[i] for the first i whose final state it contains, so earlier graphs
+ * take priority over later ones that match the same input.
+ */
+struct dfa *
+dfa_compile_union(struct nfa_graph **graphs, const int32_t *labels, int n)
+{
+	struct nfa_arena *scratch = nfa_arena_new();
+	struct nfa_arena *prev = nfa_arena_use(scratch);
+	struct nfa_compact *nfa = nfa_freeze(graphs, n);
+	struct nfa_indexset *set = nfa_indexset_new(nfa->num_states);
+	struct dfa_builder b;
+	int32_t d, e;
+	int c;
+
+	nfa_arena_use(prev);
+	builder_init(&b, nfa, labels, DFA_DEAD);
+	builder_start(&b, set);
+
+	for (d = 1; d < b.dfa->num_states; d++) {
+		for (c = 0; c < 256; c++) {
+			builder_move(&b, set, d, c);
+			e = builder_intern(&b, set);
+			b.dfa->trans[d * 256 + c] = e;
+		}
+	}
+
+	builder_finish(&b);
+	nfa_indexset_free(set);
+	nfa_arena_free(scratch);
+	dfa_find_loops(b.dfa);
+
+	return b.dfa;
+}
+
+// The lazy DFA runs the same construction on demand: a transition is only
+// computed the first time the scanner takes it. Once the states use more than
+// the cap, every state but the dead and start states is thrown away and the
+// cache refills from wherever the scan currently is. It keeps its own compact
+// copy of the NFAs, so the graphs can be freed once it is made.
+
+#define DFA_UNKNOWN (-1)
+
+struct dfa_lazy {
+	struct dfa_builder b;
+	struct nfa_arena *arena;
+	struct nfa_indexset *set;
+	size_t cap;
+	long num_flushes;
+};
+
+struct dfa_lazy *
+dfa_lazy_new(struct nfa_graph **graphs, const int32_t *labels, int n, size_t cap)
+{
+	struct dfa_lazy *lazy = emalloc(sizeof *lazy);
+	struct nfa_arena *prev;
+	struct nfa_compact *nfa;
+	int32_t *copy;
+
+	lazy->arena = nfa_arena_new();
+	prev = nfa_arena_use(lazy->arena);
+	nfa = nfa_freeze(graphs, n);
+	copy = nfa_alloc(n * sizeof *copy);
+	memcpy(copy, labels, n * sizeof *copy);
+	nfa_arena_use(prev);
+
+	lazy->set = nfa_indexset_new(nfa->num_states);
+	lazy->cap = cap;
+	lazy->num_flushes = 0;
+	builder_init(&lazy->b, nfa, copy, DFA_UNKNOWN);
+	builder_start(&lazy->b, lazy->set);
+
+	return lazy;
+}
+
+static void
+lazy_flush(struct dfa_lazy *lazy)
+{
+	struct dfa_builder *b = &lazy->b;
+
+	for (int32_t d = b->dfa->start + 1; d < b->dfa->num_states; d++) {
+		b->bytes -= state_bytes(b->sets[d].num_states);
+		free(b->sets[d].states);
+	}
+	b->dfa->num_states = b->dfa->start + 1;
+	for (int c = 0; c < 256; c++)
+		b->dfa->trans[b->dfa->start * 256 + c] = DFA_UNKNOWN;
+	builder_rehash(b, b->table_size);
+	lazy->num_flushes++;
+}
+
+/*
+ * Computes the transition from d on c. The cache is only flushed when the
+ * target is a new state that does not fit; after a flush d itself is gone
+ * unless it is the start state, so the transition is not recorded.
+ */
+static int32_t
+lazy_step(struct dfa_lazy *lazy, int32_t d, int c)
+{
+	struct dfa_builder *b = &lazy->b;
+	struct nfa_indexset *set = lazy->set;
+	uint64_t hash;
+	int32_t e;
+
+	builder_move(b, set, d, c);
+	if (set->num == 0)
+		e = DFA_DEAD;
+	else if ((e = builder_find(b, set, &hash)) < 0) {
+		if (b->bytes + state_bytes(set->num) > lazy->cap) {
+			lazy_flush(lazy);
+			if (d > b->dfa->start)
+				return builder_insert(b, set, hash);
+		}
+		e = builder_insert(b, set, hash);
+	}
+
+	b->dfa->trans[d * 256 + c] = e;
+	return e;
+}
+
+void
+dfa_lazy_free(struct dfa_lazy *lazy)
+{
+	builder_finish(&lazy->b);
+	dfa_free(lazy->b.dfa);
+	nfa_indexset_free(lazy->set);
+	nfa_arena_free(lazy->arena);
+	free(lazy);
+}
+
+/* Like dfa_simulate, but computing transitions as they are first needed. */
+off_t
+dfa_lazy_simulate(struct dfa_lazy *lazy, FILE *stream, int32_t *label)
+{
+	struct dfa *dfa = lazy->b.dfa;
+	int c;
+	int32_t state = dfa->start;
+	int32_t next;
+	off_t count = 0;
+	off_t matched_count = -1;
+	int32_t matched_label = -1;
+
+	while ((c = fgetc(stream)) != EOF) {
+		count += 1;
+
+		next = dfa->trans[state * 256 + c];
+		if (next == DFA_UNKNOWN)
+			next = lazy_step(lazy, state, c);
+		state = next;
+		if (state == DFA_DEAD)
+			break;
+
+		if (dfa->accept[state] >= 0) {
+			matched_count = count;
+			matched_label = dfa->accept[state];
+		}
+	}
+
+	if (matched_count > 0) {
+		fseek(stream, matched_count - count, SEEK_CUR);
+		if (label != NULL)
+			*label = matched_label;
+		return matched_count;
+	}
+	return -count;
+}
+
+/* Like dfa_lazy_simulate, over the n bytes at buf. */
+off_t
+dfa_lazy_simulate_buf(struct dfa_lazy *lazy, const unsigned char *buf, size_t n, int32_t *label, int *more)
+{
+	struct dfa *dfa = lazy->b.dfa;
+	int32_t state = dfa->start;
+	int32_t next;
+	size_t i;
+	off_t matched_count = -1;
+	int32_t matched_label = -1;
+
+	for (i = 0; i < n; i++) {
+		next = dfa->trans[state * 256 + buf[i]];
+		if (next == DFA_UNKNOWN)
+			next = lazy_step(lazy, state, buf[i]);
+		state = next;
+		if (state == DFA_DEAD) {
+			i++;
+			break;
+		}
+
+		if (dfa->accept[state] >= 0) {
+			matched_count = i + 1;
+			matched_label = dfa->accept[state];
+		}
+	}
+
+	if (more != NULL)
+		*more = state != DFA_DEAD;
+	if (matched_count > 0) {
+		if (label != NULL)
+			*label = matched_label;
+		return matched_count;
+	}
+	return -(off_t)i;
+}
+
+void
+dfa_lazy_report(FILE *f, const char *name, struct dfa_lazy *lazy)
+{
+	fprintf(f, "%s: %d states cached (%zu of %zu KiB), %ld flushes\n", name,
+	    lazy->b.dfa->num_states, lazy->b.bytes / 1024, lazy->cap / 1024, lazy->num_flushes);
+}
+
+/*
+ * Finds the longest prefix of stream accepted by dfa. On success the stream is
+ * left just past the match, its label is stored through label (if not NULL)
+ * and the length is returned. Otherwise minus the number of bytes read.
+ */
+off_t
+dfa_simulate(const struct dfa *dfa, FILE *stream, int32_t *label)
+{
+	int c;
+	int32_t state = dfa->start;
+	off_t count = 0;
+	off_t matched_count = -1;
+	int32_t matched_label = -1;
+
+	while ((c = fgetc(stream)) != EOF) {
+		count += 1;
+
+		state = dfa->trans[state * 256 + c];
+		if (state == DFA_DEAD)
+			break;
+
+		if (dfa->accept[state] >= 0) {
+			matched_count = count;
+			matched_label = dfa->accept[state];
+		}
+	}
+
+	if (matched_count > 0) {
+		fseek(stream, matched_count - count, SEEK_CUR);
+		if (label != NULL)
+			*label = matched_label;
+		return matched_count;
+	}
+	return -count;
+}
+
+// Most bytes of typical input are in runs that leave the DFA where it is: the
+// body of an identifier, a number or a string. For each state whose self-loop
+// covers enough bytes, and whose class (or its complement) is a few ranges,
+// dfa_find_loops records the ranges, and scanning a buffer skips the rest of
+// such a run with vector compares, 16 or 32 bytes at a time.
+
+#define LOOP_MIN_BYTES 8
+
+/* Returns the number of ranges covering exactly the bytes in set, up to max + 1. */
+static int
+byte_ranges(const uint8_t set[256], int want, uint8_t *lo, uint8_t *hi, int max)
+{
+	int n = 0;
+
+	for (int c = 0; c < 256; c++) {
+		if (set[c] != want || (c > 0 && set[c - 1] == want))
+			continue;
+		if (n < max)
+			lo[n] = c;
+		while (c < 255 && set[c + 1] == want)
+			c++;
+		if (n < max)
+			hi[n] = c;
+		if (++n > max)
+			break;
+	}
+	return n;
+}
+
+void
+dfa_find_loops(struct dfa *dfa)
+{
+	uint8_t stay[256];
+
+	dfa->loop = emalloc(dfa->num_states * sizeof *dfa->loop);
+	dfa->loops = emalloc(sizeof *dfa->loops);
+	dfa->num_loops = 0;
+
+	for (int32_t d = 0; d < dfa->num_states; d++) {
+		struct dfa_loop l = {0};
+		int num = 0, n;
+
+		dfa->loop[d] = -1;
+		if (d == DFA_DEAD)
+			continue;
+		for (int c = 0; c < 256; c++)
+			num += stay[c] = dfa->trans[d * 256 + c] == d;
+		if (num < LOOP_MIN_BYTES)
+			continue;
+
+		if ((n = byte_ranges(stay, 1, l.lo, l.hi, DFA_LOOP_RANGES)) <= DFA_LOOP_RANGES) {
+			l.negate = 0;
+		} else if ((n = byte_ranges(stay, 0, l.lo, l.hi, DFA_LOOP_RANGES)) <= DFA_LOOP_RANGES) {
+			l.negate = 1;
+		} else {
+			continue;
+		}
+		l.num_ranges = n;
+
+		dfa->loops = erealloc(dfa->loops, (dfa->num_loops + 1) * sizeof *dfa->loops);
+		dfa->loops[dfa->num_loops] = l;
+		dfa->loop[d] = dfa->num_loops++;
+	}
+}
+
+static int
+loop_contains(const struct dfa_loop *l, unsigned char c)
+{
+	int in = 0;
+
+	for (int k = 0; k < l->num_ranges; k++)
+		in |= (uint8_t)(c - l->lo[k]) <= (uint8_t)(l->hi[k] - l->lo[k]);
+	return in != l->negate;
+}
+
+/*
+ * Returns how many of the n bytes at p stay in the loop. A byte is in a range
+ * if it minus lo, wrapping, is at most hi minus lo, which is an unsigned min
+ * and a compare for each range.
+ */
+static size_t
+loop_run(const struct dfa_loop *l, const unsigned char *p, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i in = _mm256_setzero_si256();
+		uint32_t leave;
+		for (int k = 0; k < l->num_ranges; k++) {
+			__m256i t = _mm256_sub_epi8(x, _mm256_set1_epi8(l->lo[k]));
+			__m256i w = _mm256_set1_epi8(l->hi[k] - l->lo[k]);
+			in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_min_epu8(t, w), t));
+		}
+		leave = (uint32_t)_mm256_movemask_epi8(in);
+		if (!l->negate)
+			leave = ~leave;
+		if (leave != 0)
+			return i + __builtin_ctz(leave);
+	}
+#elif defined(__SSE2__)
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i in = _mm_setzero_si128();
+		uint32_t leave;
+		for (int k = 0; k < l->num_ranges; k++) {
+			__m128i t = _mm_sub_epi8(x, _mm_set1_epi8(l->lo[k]));
+			__m128i w = _mm_set1_epi8(l->hi[k] - l->lo[k]);
+			in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(t, w), t));
+		}
+		leave = (uint32_t)_mm_movemask_epi8(in);
+		if (!l->negate)
+			leave = ~leave & 0xffff;
+		if (leave != 0)
+			return i + __builtin_ctz(leave);
+	}
+#endif
+	for (; i < n; i++)
+		if (!loop_contains(l, p[i]))
+			break;
+	return i;
+}
+
+/*
+ * Like dfa_simulate, over the n bytes at buf. Since nothing is consumed there
+ * is nothing to put back: the caller just advances by the length returned.
+ * If more is not NULL, it is set when the automaton was still running at the
+ * end of buf, so that more input could give a longer match.
+ */
+off_t
+dfa_simulate_buf(const struct dfa *dfa, const unsigned char *buf, size_t n, int32_t *label, int *more)
+{
+	int32_t state = dfa->start;
+	size_t i;
+	off_t matched_count = -1;
+	int32_t matched_label = -1;
+
+	for (i = 0; i < n; i++) {
+		state = dfa->trans[state * 256 + buf[i]];
+		if (state == DFA_DEAD) {
+			i++;
+			break;
+		}
+
+		/* Most runs are short, so only start the kernel if the next byte stays. */
+		if (dfa->loop != NULL && dfa->loop[state] >= 0 && i + 1 < n &&
+		    dfa->trans[state * 256 + buf[i + 1]] == state)
+			i += 1 + loop_run(&dfa->loops[dfa->loop[state]], buf + i + 2, n - i - 2);
+
+		if (dfa->accept[state] >= 0) {
+			matched_count = i + 1;
+			matched_label = dfa->accept[state];
+		}
+	}
+
+	if (more != NULL)
+		*more = state != DFA_DEAD;
+	if (matched_count > 0) {
+		if (label != NULL)
+			*label = matched_label;
+		return matched_count;
+	}
+	return -(off_t)i;
+}
+
+void
+dfa_free(struct dfa *dfa)
+{
+	free(dfa->trans);
+	free(dfa->accept);
+	free(dfa->loop);
+	free(dfa->loops);
+	free(dfa);
+}
+
+// Hopcroft's partition refinement. Blocks are contiguous ranges of elems, and
+// splitting a block moves its marked states to the front of its range. States
+// start out partitioned by label, so merged states always accept the same
+// token.
+
+struct dfa_partition {
+	int32_t *elems;  /* states, grouped by block */
+	int32_t *loc;    /* position of each state in elems */
+	int32_t *blk;    /* block of each state */
+	int32_t *first;  /* start of each block in elems */
+	int32_t *end;    /* end of each block in elems */
+	int32_t *marked; /* number of marked states at the front of each block */
+	int32_t num_blocks;
+};
+
+static int32_t
+partition_split(struct dfa_partition *p, int32_t y)
+{
+	int32_t z = p->num_blocks++;
+
+	p->first[z] = p->first[y];
+	p->end[z] = p->first[y] + p->marked[y];
+	p->marked[z] = 0;
+	p->first[y] = p->end[z];
+	for (int32_t i = p->first[z]; i < p->end[z]; i++)
+		p->blk[p->elems[i]] = z;
+
+	return z;
+}
+
+static void
+partition_mark(struct dfa_partition *p, int32_t s, int32_t *touched, int32_t *num_touched)
+{
+	int32_t y = p->blk[s];
+	int32_t i = p->loc[s];
+	int32_t j = p->first[y] + p->marked[y];
+	int32_t t = p->elems[j];
+
+	if (i < j)
+		return;
+
+	p->elems[j] = s;
+	p->loc[s] = j;
+	p->elems[i] = t;
+	p->loc[t] = i;
+
+	if (p->marked[y]++ == 0)
+		touched[(*num_touched)++] = y;
+}
+
+struct dfa *
+dfa_minimize(struct dfa *dfa)
+{
+	int32_t n = dfa->num_states;
+	struct dfa_partition part;
+	struct dfa *min;
+	int32_t *inv_off, *inv_src, *work, *touched, *splitter, *order, *renum;
+	unsigned char *in_work;
+	int32_t num_work = 0, num_touched, num_splitter;
+	int32_t s, i, c, b;
+
+	/* Predecessors of each state under each byte, bucketed by c * n + target. */
+	inv_off = emalloc(((ptrdiff_t)256 * n + 1) * sizeof *inv_off);
+	inv_src = emalloc((ptrdiff_t)256 * n * sizeof *inv_src);
+	memset(inv_off, 0, ((ptrdiff_t)256 * n + 1) * sizeof *inv_off);
+	for (s = 0; s < n; s++)
+		for (c = 0; c < 256; c++)
+			inv_off[c * n + dfa->trans[s * 256 + c] + 1]++;
+	for (i = 0; i < 256 * n; i++)
+		inv_off[i + 1] += inv_off[i];
+	for (s = 0; s < n; s++)
+		for (c = 0; c < 256; c++) {
+			int32_t k = c * n + dfa->trans[s * 256 + c];
+			inv_src[inv_off[k]++] = s;
+		}
+	for (i = 256 * n; i > 0; i--)
+		inv_off[i] = inv_off[i - 1];
+	inv_off[0] = 0;
+
+	part.elems = emalloc(n * sizeof *part.elems);
+	part.loc = emalloc(n * sizeof *part.loc);
+	part.blk = emalloc(n * sizeof *part.blk);
+	part.first = emalloc(n * sizeof *part.first);
+	part.end = emalloc(n * sizeof *part.end);
+	part.marked = emalloc(n * sizeof *part.marked);
+	part.num_blocks = 0;
+
+	/* The initial partition groups states by label, in order of first appearance. */
+	order = emalloc(n * sizeof *order);
+	for (s = 0; s < n; s++)
+		order[s] = -1;
+	i = 0;
+	for (s = 0; s < n; s++) {
+		if (order[s] >= 0)
+			continue;
+		b = part.num_blocks++;
+		part.first[b] = i;
+		part.marked[b] = 0;
+		for (int32_t t = s; t < n; t++) {
+			if (order[t] < 0 && dfa->accept[t] == dfa->accept[s]) {
+				order[t] = b;
+				part.elems[i] = t;
+				part.loc[t] = i;
+				part.blk[t] = b;
+				i++;
+			}
+		}
+		part.end[b] = i;
+	}
+
+	work = emalloc((ptrdiff_t)256 * n * sizeof *work);
+	in_work = emalloc((ptrdiff_t)256 * n);
+	memset(in_work, 0, (ptrdiff_t)256 * n);
+	for (b = 0; b < part.num_blocks; b++)
+		for (c = 0; c < 256; c++) {
+			work[num_work++] = b * 256 + c;
+			in_work[b * 256 + c] = 1;
+		}
+
+	touched = emalloc(n * sizeof *touched);
+	splitter = emalloc(n * sizeof *splitter);
+
+	while (num_work > 0) {
+		int32_t a = work[--num_work];
+		c = a % 256;
+		in_work[a] = 0;
+		a /= 256;
+
+		/* Copy the splitter first: marking may reorder its block. */
+		num_splitter = 0;
+		for (i = part.first[a]; i < part.end[a]; i++)
+			splitter[num_splitter++] = part.elems[i];
+
+		num_touched = 0;
+		for (i = 0; i < num_splitter; i++) {
+			int32_t k = c * n + splitter[i];
+			for (int32_t j = inv_off[k]; j < inv_off[k + 1]; j++)
+				partition_mark(&part, inv_src[j], touched, &num_touched);
+		}
+
+		for (i = 0; i < num_touched; i++) {
+			int32_t y = touched[i], z;
+
+			if (part.marked[y] == part.end[y] - part.first[y]) {
+				part.marked[y] = 0;
+				continue;
+			}
+
+			z = partition_split(&part, y);
+			part.marked[y] = 0;
+			for (int32_t d = 0; d < 256; d++) {
+				int32_t add;
+				if (in_work[y * 256 + d])
+					add = z;
+				else if (part.end[z] - part.first[z] < part.end[y] - part.first[y])
+					add = z;
+				else
+					add = y;
+				work[num_work++] = add * 256 + d;
+				in_work[add * 256 + d] = 1;
+			}
+		}
+	}
+
+	/* Number the blocks breadth-first from the start, with the dead state's block first. */
+	renum = emalloc(part.num_blocks * sizeof *renum);
+	for (b = 0; b < part.num_blocks; b++)
+		renum[b] = -1;
+	renum[part.blk[DFA_DEAD]] = DFA_DEAD;
+	order[0] = part.blk[DFA_DEAD];
+	i = 1;
+	if (renum[part.blk[dfa->start]] < 0) {
+		renum[part.blk[dfa->start]] = i;
+		order[i++] = part.blk[dfa->start];
+	}
+
+	min = emalloc(sizeof *min);
+	min->trans = emalloc((ptrdiff_t)part.num_blocks * 256 * sizeof *min->trans);
+	min->accept = emalloc(part.num_blocks * sizeof *min->accept);
+	min->num_states = part.num_blocks;
+	min->start = renum[part.blk[dfa->start]];
+
+	for (int32_t k = 0; k < i; k++) {
+		b = order[k];
+		s = part.elems[part.first[b]];
+		min->accept[k] = dfa->accept[s];
+		for (c = 0; c < 256; c++) {
+			int32_t t = part.blk[dfa->trans[s * 256 + c]];
+			if (renum[t] < 0) {
+				renum[t] = i;
+				order[i++] = t;
+			}
+			min->trans[k * 256 + c] = renum[t];
+		}
+	}
+
+	free(inv_off);
+	free(inv_src);
+	free(part.elems);
+	free(part.loc);
+	free(part.blk);
+	free(part.first);
+	free(part.end);
+	free(part.marked);
+	free(order);
+	free(work);
+	free(in_work);
+	free(touched);
+	free(splitter);
+	free(renum);
+	dfa_find_loops(min);
+
+	return min;
+}
+
+void
+dfa_report(FILE *f, const char *name, struct dfa *before, struct dfa *after)
+{
+	fprintf(f, "%s: %d states (%zu KiB) minimized to %d states (%zu KiB)\n", name,
+	    before->num_states, before->num_states * (256 + 1) * sizeof(int32_t) / 1024,
+	    after->num_states, after->num_states * (256 + 1) * sizeof(int32_t) / 1024);
+}
+
+// Compiled DFAs can be saved to a file and mapped back in. The file is a
+// header followed by the transition and accept tables exactly as they are laid
+// out in memory, each aligned to a cache line, so loading is just mmap and a
+// check of the header. The byte order field rejects files written on a machine
+// with different endianness.
+
+#define DFA_FILE_MAGIC "MORTDFA"
+#define DFA_FILE_VERSION 1
+#define DFA_FILE_ALIGN 64
+
+struct dfa_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	int32_t num_states;
+	int32_t start;
+	uint64_t trans_offset;
+	uint64_t accept_offset;
+	uint64_t size;
+};
+
+static uint64_t
+align_up(uint64_t n)
+{
+	return (n + DFA_FILE_ALIGN - 1) & ~(uint64_t)(DFA_FILE_ALIGN - 1);
+}
+
+static int
+write_padded(FILE *f, const void *p, size_t n, uint64_t *off)
+{
+	static const char zeroes[DFA_FILE_ALIGN];
+	uint64_t pad = align_up(*off + n) - (*off + n);
+
+	if (fwrite(p, 1, n, f) != n || fwrite(zeroes, 1, pad, f) != pad)
+		return -1;
+	*off += n + pad;
+	return 0;
+}
+
+int
+dfa_save(const struct dfa *dfa, const char *path)
+{
+	struct dfa_file_header h;
+	size_t trans_size = (size_t)dfa->num_states * 256 * sizeof *dfa->trans;
+	size_t accept_size = (size_t)dfa->num_states * sizeof *dfa->accept;
+	uint64_t off = 0;
+	FILE *f;
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, DFA_FILE_MAGIC, sizeof DFA_FILE_MAGIC);
+	h.version = DFA_FILE_VERSION;
+	h.byte_order = 0x01020304;
+	h.num_states = dfa->num_states;
+	h.start = dfa->start;
+	h.trans_offset = align_up(sizeof h);
+	h.accept_offset = align_up(h.trans_offset + trans_size);
+	h.size = align_up(h.accept_offset + accept_size);
+
+	if ((f = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "Cannot open %s for writing\n", path);
+		return -1;
+	}
+	if (write_padded(f, &h, sizeof h, &off) != 0 ||
+	    write_padded(f, dfa->trans, trans_size, &off) != 0 ||
+	    write_padded(f, dfa->accept, accept_size, &off) != 0) {
+		fprintf(stderr, "Cannot write %s\n", path);
+		fclose(f);
+		return -1;
+	}
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Cannot write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Checks the tables of a mapped file once, so the scanners can index with
+ * every transition and label without checking: each transition must be a
+ * state and each label below num_labels.
+ */
+static int
+valid_tables(const int32_t *trans, const int32_t *accept, int32_t num_states, int32_t num_labels)
+{
+	for (size_t i = 0; i < (size_t)num_states * 256; i++)
+		if ((uint32_t)trans[i] >= (uint32_t)num_states)
+			return 0;
+	for (int32_t d = 0; d < num_states; d++)
+		if (accept[d] < -1 || accept[d] >= num_labels)
+			return 0;
+	return 1;
+}
+
+/*
+ * Maps a file written by dfa_save. The tables are shared read-only with every
+ * other process that maps the same file, and stay mapped for the life of the
+ * process. Returns NULL if the file cannot be mapped, is not a DFA file, or
+ * accepts a label that is not below num_labels.
+ */
+const struct dfa *
+dfa_load(const char *path, int32_t num_labels)
+{
+	const struct dfa_file_header *h;
+	struct dfa *dfa;
+	struct stat st;
+	uint64_t trans_size, accept_size;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof *h) {
+		fprintf(stderr, "%s is not a DFA file\n", path);
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Cannot map %s\n", path);
+		return NULL;
+	}
+
+	/* Every offset is checked against what is left of the file, so none of
+	 * the sums below can wrap. */
+	h = map;
+	trans_size = (uint64_t)(h->num_states > 0 ? h->num_states : 0) * 256 * sizeof(int32_t);
+	accept_size = (uint64_t)(h->num_states > 0 ? h->num_states : 0) * sizeof(int32_t);
+	if (memcmp(h->magic, DFA_FILE_MAGIC, sizeof DFA_FILE_MAGIC) != 0 ||
+	    h->version != DFA_FILE_VERSION || h->byte_order != 0x01020304 ||
+	    h->size != (uint64_t)st.st_size || h->num_states < 1 ||
+	    h->start < 0 || h->start >= h->num_states ||
+	    h->trans_offset < sizeof *h || h->trans_offset % sizeof(int32_t) != 0 ||
+	    h->accept_offset < sizeof *h || h->accept_offset % sizeof(int32_t) != 0 ||
+	    h->trans_offset > h->size || h->size - h->trans_offset < trans_size ||
+	    h->accept_offset < h->trans_offset + trans_size ||
+	    h->accept_offset > h->size || h->size - h->accept_offset < accept_size ||
+	    !valid_tables((const int32_t *)((char *)map + h->trans_offset),
+	                  (const int32_t *)((char *)map + h->accept_offset),
+	                  h->num_states, num_labels)) {
+		fprintf(stderr, "%s is not a DFA file\n", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	dfa = emalloc(sizeof *dfa);
+	dfa->trans = (int32_t *)((char *)map + h->trans_offset);
+	dfa->accept = (int32_t *)((char *)map + h->accept_offset);
+	dfa->num_states = h->num_states;
+	dfa->start = h->start;
+	dfa_find_loops(dfa);
+	return dfa;
+}
@@ -0,0 +1,32 @@
+#define DFA_DEAD 0
+#define DFA_LOOP_RANGES 4
+struct dfa_loop {
+	uint8_t lo[DFA_LOOP_RANGES]; /* inclusive byte ranges */
+	uint8_t hi[DFA_LOOP_RANGES];
+	uint8_t num_ranges;
+	uint8_t negate;              /* the ranges are the bytes that leave the state */
+};
+struct dfa {
+	int32_t *trans;  /* num_states * 256 entries, indexed by state * 256 + byte */
+	int32_t *accept; /* label accepted in each state, or -1 */
+	int32_t num_states;
+	int32_t start;
+	int32_t *loop;          /* index in loops of each state's self-loop, or -1; may be NULL */
+	struct dfa_loop *loops;
+	int32_t num_loops;
+};
+extern struct dfa *dfa_compile_union(struct nfa_graph **graphs, const int32_t *labels, int n);
+extern struct dfa *dfa_minimize(struct dfa *dfa);
+extern void dfa_find_loops(struct dfa *dfa);
+extern void dfa_report(FILE *f, const char *name, struct dfa *before, struct dfa *after);
+extern void dfa_free(struct dfa *dfa);
+extern int dfa_save(const struct dfa *dfa, const char *path);
+extern const struct dfa *dfa_load(const char *path, int32_t num_labels);
+extern off_t dfa_simulate(const struct dfa *dfa, FILE *stream, int32_t *label);
+extern off_t dfa_simulate_buf(const struct dfa *dfa, const unsigned char *buf, size_t n, int32_t *label, int *more);
+struct dfa_lazy;
+extern struct dfa_lazy *dfa_lazy_new(struct nfa_graph **graphs, const int32_t *labels, int n, size_t cap);
+extern off_t dfa_lazy_simulate(struct dfa_lazy *lazy, FILE *stream, int32_t *label);
+extern off_t dfa_lazy_simulate_buf(struct dfa_lazy *lazy, const unsigned char *buf, size_t n, int32_t *label, int *more);
+extern void dfa_lazy_report(FILE *f, const char *name, struct dfa_lazy *lazy);
+extern void dfa_lazy_free(struct dfa_lazy *lazy);
@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "nfa.h"
+#include "glushkov.h"
+
+// Bit-parallel simulation of the position (Glushkov) automaton of an NFA. Each
+// labelled transition of the Thompson NFA is a position, and the set of
+// positions last taken fits in one word, so a step is a few table lookups and
+// word operations whatever the number of active states. Positions that can
+// follow a set are looked up eight positions at a time.
+
+/* Returns the positions leaving any state in list. */
+static uint64_t
+leaving(struct nfa_statelist *list, struct nfa_statelist *states, const uint64_t *out)
+{
+	uint64_t mask = 0;
+
+	for (ptrdiff_t i = 0; i < list->num_states; i++)
+		mask |= out[states->sparse[list->states[i]->id]];
+	return mask;
+}
+
+/*
+ * Returns NULL if g has more than GLUSHKOV_MAX_POSITIONS labelled transitions,
+ * in which case it has to be simulated some other way.
+ */
+struct glushkov *
+glushkov_compile(struct nfa_graph *g)
+{
+	struct nfa_statelist *states = nfa_statelist_new(g->num_ids);
+	struct nfa_statelist *closure = nfa_statelist_new(g->num_ids);
+	struct nfa_state *target[GLUSHKOV_MAX_POSITIONS];
+	uint64_t follow[GLUSHKOV_MAX_POSITIONS];
+	uint64_t bytes[256];
+	uint64_t *out;
+	struct glushkov *gl;
+	int n = 0, c, k;
+
+	memset(bytes, 0, sizeof bytes);
+	nfa_statelist_reachable(states, g->initial_state, 0);
+	out = emalloc(states->num_states * sizeof *out);
+
+	for (ptrdiff_t i = 0; i < states->num_states; i++) {
+		struct nfa_state *s = states->states[i];
+		struct nfa_trans *trans[2] = {&s->trans1, &s->trans2};
+
+		out[i] = 0;
+		for (int j = 0; j < 2; j++) {
+			if (trans[j]->endpoint == NULL || trans[j]->valid == NULL)
+				continue;
+			if (n == GLUSHKOV_MAX_POSITIONS) {
+				free(out);
+				nfa_statelist_free(states);
+				nfa_statelist_free(closure);
+				return NULL;
+			}
+			for (c = 0; c < 256; c++)
+				if (nfa_trans_matches(trans[j], c))
+					bytes[c] |= (uint64_t)1 << n;
+			target[n] = trans[j]->endpoint;
+			out[i] |= (uint64_t)1 << n;
+			n++;
+		}
+	}
+
+	/* Allocated with the graph, so it is released along with it. */
+	gl = nfa_alloc(sizeof *gl);
+	memcpy(gl->bytes, bytes, sizeof bytes);
+	nfa_statelist_clear(closure);
+	nfa_statelist_pushclosure(closure, g->initial_state);
+	gl->first = leaving(closure, states, out);
+	gl->last = 0;
+	for (int p = 0; p < n; p++) {
+		nfa_statelist_clear(closure);
+		nfa_statelist_pushclosure(closure, target[p]);
+		follow[p] = leaving(closure, states, out);
+		if (nfa_statelist_contains(closure, g->final_state))
+			gl->last |= (uint64_t)1 << p;
+	}
+
+	gl->num_positions = n;
+	gl->num_chunks = (n + 7) / 8;
+	gl->follow = nfa_alloc((gl->num_chunks ? gl->num_chunks : 1) * sizeof *gl->follow);
+	for (k = 0; k < gl->num_chunks; k++) {
+		for (int v = 0; v < 256; v++) {
+			uint64_t mask = 0;
+			for (int j = 0; j < 8 && 8 * k + j < n; j++)
+				if (v & (1 << j))
+					mask |= follow[8 * k + j];
+			gl->follow[k][v] = mask;
+		}
+	}
+
+	free(out);
+	nfa_statelist_free(states);
+	nfa_statelist_free(closure);
+	return gl;
+}
+
+/* Has the same contract as simulate() and dfa_simulate(). */
+off_t
+glushkov_simulate(const struct glushkov *gl, FILE *stream)
+{
+	int c;
+	uint64_t reach = gl->first;
+	uint64_t active;
+	off_t count = 0;
+	off_t matched_count = -1;
+
+	while ((c = fgetc(stream)) != EOF) {
+		count += 1;
+
+		active = reach & gl->bytes[c];
+		if (active == 0)
+			break;
+
+		if (active & gl->last)
+			matched_count = count;
+
+		reach = 0;
+		for (int k = 0; k < gl->num_chunks; k++)
+			reach |= gl->follow[k][(active >> (8 * k)) & 0xff];
+	}
+
+	if (matched_count > 0) {
+		fseek(stream, matched_count - count, SEEK_CUR);
+		return matched_count;
+	}
+	return -count;
+}
+
+/* Like glushkov_simulate, over the n bytes at buf, with more as for dfa_simulate_buf. */
+off_t
+glushkov_simulate_buf(const struct glushkov *gl, const unsigned char *buf, size_t n, int *more)
+{
+	uint64_t reach = gl->first;
+	uint64_t active;
+	size_t i;
+	off_t matched_count = -1;
+
+	for (i = 0; i < n; i++) {
+		active = reach & gl->bytes[buf[i]];
+		if (active == 0) {
+			reach = 0;
+			i++;
+			break;
+		}
+
+		if (active & gl->last)
+			matched_count = i + 1;
+
+		reach = 0;
+		for (int k = 0; k < gl->num_chunks; k++)
+			reach |= gl->follow[k][(active >> (8 * k)) & 0xff];
+	}
+
+	if (more != NULL)
+		*more = reach != 0;
+	if (matched_count > 0)
+		return matched_count;
+	return -(off_t)i;
+}
@@ -0,0 +1,12 @@
+#define GLUSHKOV_MAX_POSITIONS 64
+struct glushkov {
+	uint64_t first;          /* positions that can match the first byte */
+	uint64_t last;           /* positions after which the pattern has matched */
+	uint64_t bytes[256];     /* positions whose class contains each byte */
+	uint64_t (*follow)[256]; /* positions that can follow each 8-position chunk */
+	int num_positions;
+	int num_chunks;
+};
+extern struct glushkov *glushkov_compile(struct nfa_graph *g);
+extern off_t glushkov_simulate(const struct glushkov *gl, FILE *stream);
+extern off_t glushkov_simulate_buf(const struct glushkov *gl, const unsigned char *buf, size_t n, int *more);
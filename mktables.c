@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "util.h"
+
+#include "tok.h"
+#include "nfa.h"
+#include "dfa.h"
+#include "tok_scanner.h"
+
+// Compiles the token definitions from init_tokens into a minimized DFA and
+// writes it out as static const C tables, so that mort can be built with
+// -DMORT_STATIC_TABLES and start scanning without constructing anything:
+//
+//     cc -pthread -o mktables mktables.c nfa.c dfa.c glushkov.c tok.c tok_scanner.c
+//     ./mktables tok_tables.c
+//     cc -pthread -DMORT_STATIC_TABLES -o mort mort.c nfa.c dfa.c glushkov.c tok.c tok_scanner.c tok_tables.c
+//
+// With -b it writes the tables in the binary format read by dfa_load. Those
+// keep the keywords in the DFA, so a loaded DFA needs nothing else; the C
+// tables leave them out and include a table for them as tok_static_keywords.
+
+static void emit_array(FILE *f, const char *name, const int32_t *a, ptrdiff_t n)
+{
+	fprintf(f, "static const int32_t %s[%td] = {", name, n);
+	for (ptrdiff_t i = 0; i < n; i++) {
+		if (i % 16 == 0)
+			fprintf(f, "\n\t");
+		fprintf(f, "%d,", a[i]);
+	}
+	fprintf(f, "\n};\n\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct tok_defn *tokens;
+	struct dfa *dfa;
+	struct tok_keywords *kw;
+	FILE *f = stdout;
+	int binary = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		binary = 1;
+		argc--;
+		argv++;
+	}
+	if (argc > 2 || (binary && argc != 2)) {
+		fprintf(stderr, "usage: mktables [output.c]\n       mktables -b output.dfa\n");
+		return 2;
+	}
+
+	init_tokens(&tokens);
+	if (binary) {
+		dfa = tok_compile(tokens, NUM_TOKENS, NULL, stderr);
+		return dfa_save(dfa, argv[1]) == 0 ? 0 : 1;
+	}
+	if ((kw = tok_keywords_new(tokens, NUM_TOKENS)) == NULL)
+		return 1;
+	dfa = tok_compile(tokens, NUM_TOKENS, kw, stderr);
+
+	if (argc == 2 && (f = fopen(argv[1], "w")) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	fprintf(f, "/* Generated by mktables from init_tokens. Do not edit. */\n");
+	fprintf(f, "#include <stddef.h>\n");
+	fprintf(f, "#include <stdint.h>\n");
+	fprintf(f, "#include <stdio.h>\n");
+	fprintf(f, "#include <sys/types.h>\n");
+	fprintf(f, "#include \"nfa.h\"\n");
+	fprintf(f, "#include \"dfa.h\"\n");
+	fprintf(f, "#include \"tok_scanner.h\"\n\n");
+	emit_array(f, "trans", dfa->trans, (ptrdiff_t)dfa->num_states * 256);
+	emit_array(f, "accept", dfa->accept, dfa->num_states);
+	emit_array(f, "loop", dfa->loop, dfa->num_states);
+	fprintf(f, "static const struct dfa_loop loops[%d] = {\n", dfa->num_loops > 0 ? dfa->num_loops : 1);
+	for (int32_t i = 0; i < dfa->num_loops; i++) {
+		const struct dfa_loop *l = &dfa->loops[i];
+		fprintf(f, "\t{.lo = {");
+		for (int k = 0; k < l->num_ranges; k++)
+			fprintf(f, "%d,", l->lo[k]);
+		fprintf(f, "}, .hi = {");
+		for (int k = 0; k < l->num_ranges; k++)
+			fprintf(f, "%d,", l->hi[k]);
+		fprintf(f, "}, .num_ranges = %d, .negate = %d},\n", l->num_ranges, l->negate);
+	}
+	fprintf(f, "};\n\n");
+	fprintf(f, "const struct dfa tok_static_dfa = {\n");
+	fprintf(f, "\t.trans = (int32_t *)trans,\n");
+	fprintf(f, "\t.accept = (int32_t *)accept,\n");
+	fprintf(f, "\t.num_states = %d,\n", dfa->num_states);
+	fprintf(f, "\t.start = %d,\n", dfa->start);
+	fprintf(f, "\t.loop = (int32_t *)loop,\n");
+	fprintf(f, "\t.loops = (struct dfa_loop *)loops,\n");
+	fprintf(f, "\t.num_loops = %d,\n", dfa->num_loops);
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static const char *const keyword_spelling[%u] = {", kw->mask + 1);
+	for (uint32_t i = 0; i <= kw->mask; i++) {
+		if (i % 8 == 0)
+			fprintf(f, "\n\t");
+		if (kw->spelling[i] != NULL)
+			fprintf(f, "\"%s\",", kw->spelling[i]);
+		else
+			fprintf(f, "NULL,");
+	}
+	fprintf(f, "\n};\n\n");
+	fprintf(f, "static const int keyword_type[%u] = {", kw->mask + 1);
+	for (uint32_t i = 0; i <= kw->mask; i++) {
+		if (i % 16 == 0)
+			fprintf(f, "\n\t");
+		fprintf(f, "%d,", kw->spelling[i] != NULL ? kw->type[i] : -1);
+	}
+	fprintf(f, "\n};\n\n");
+	fprintf(f, "const struct tok_keywords tok_static_keywords = {\n");
+	fprintf(f, "\t.seed = %u,\n", kw->seed);
+	fprintf(f, "\t.mask = %u,\n", kw->mask);
+	fprintf(f, "\t.min_len = %zu,\n", kw->min_len);
+	fprintf(f, "\t.max_len = %zu,\n", kw->max_len);
+	fprintf(f, "\t.spelling = keyword_spelling,\n");
+	fprintf(f, "\t.type = keyword_type,\n");
+	fprintf(f, "};\n");
+
+	if (ferror(f) || fclose(f) != 0) {
+		fprintf(stderr, "Could not write tables\n");
+		return 1;
+	}
+	return 0;
+}
@@ -1,9 +1,14 @@
 #define _GNU_SOURCE
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -11,53 +16,432 @@
 
 #include "tok.h"
 #include "nfa.h"
+#include "dfa.h"
 #include "tok_scanner.h"
 
 // The scanner, parser, etc. have a 'pull' structure. Rather than reading the
 // entire input file into memory, turning it into tokens, then parsing the rest
 // of the file, the file is tokenised lazily as the tokens are required by the
-// parser.
+// parser. They are scanned a batch at a time, with whitespace and newlines
+// already left out by the scanner. With -l, input.txt is scanned by the lazy
+// DFA instead, which builds only the states the input reaches and keeps them
+// to at most about the given number of bytes.
+//
+// With -d, the compiled DFA is mapped from the given file rather than built,
+// or built and saved there if there is no such file yet. A file that does not
+// load is left alone, and the DFA built as if there were none.
 
-static struct token *get_token_nows(struct tok_scanner *s)
+#define MAIN_ITEMS 256
+
+// Given files on the command line, mort lexes them all as a batch instead and
+// writes the tokens of each to a .tok file, one per line. The token set is
+// compiled once and shared read-only by a pool of threads. Each thread has a
+// deque of files, taking from the back of its own and, once that is empty,
+// stealing from the front of the others', so a thread that drew large files
+// does not hold up the rest. Tokens are scanned a few thousand at a time into
+// an array each thread keeps for the whole run and written out from there, so
+// lexing a file allocates nothing per token and needs no more memory for a
+// larger one. Inputs that would share a .tok file, such as two files of the
+// same name with -o, are refused before anything is lexed.
+
+#define BATCH_ITEMS 4096
+
+// With a cache directory, the tokens of each file are also saved there, keyed
+// by a hash of the file's contents and a fingerprint of the token set, so an
+// unchanged file is loaded instead of lexed the next time. Once the batch is
+// done, the cache is trimmed to its size.
+
+#define BATCH_CACHE_SIZE (256 * 1024 * 1024)
+
+struct batch_queue {
+	pthread_mutex_t lock;
+	int *files;
+	int front;  /* thieves take files[front] */
+	int back;   /* the owner takes files[back - 1] */
+};
+
+struct batch {
+	char **paths;
+	const char *outdir;       /* for the .tok files, or NULL to put them beside the input */
+	const struct dfa *dfa;
+	const struct tok_keywords *keywords;
+	const char *cache;        /* directory of saved tokens, or NULL */
+	uint64_t cache_size;      /* in bytes, that the cache is trimmed to */
+	uint64_t fingerprint;     /* of the token set */
+	struct batch_queue *queues;
+	int num_threads;
+	int failed;
+};
+
+struct batch_worker {
+	struct batch *b;
+	int id;
+	pthread_t thread;
+	int running;                        /* if thread was started and must be joined */
+	struct tok_item items[BATCH_ITEMS]; /* reused for every batch of tokens */
+};
+
+static int batch_next(struct batch *b, int id, int *file)
 {
-	struct token *t;
-label:
-	if ((t = get_token(s))) {
-		switch (t->type) {
-			case TOKEN_NEWLINE:
-			case TOKEN_WS:
-				goto label;
+	struct batch_queue *q = &b->queues[id];
+	int found = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->front < q->back) {
+		*file = q->files[--q->back];
+		found = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	/* Nothing is queued once the batch starts, so an empty pool stays empty. */
+	for (int k = 1; !found && k < b->num_threads; k++) {
+		q = &b->queues[(id + k) % b->num_threads];
+		pthread_mutex_lock(&q->lock);
+		if (q->front < q->back) {
+			*file = q->files[q->front++];
+			found = 1;
 		}
+		pthread_mutex_unlock(&q->lock);
 	}
-	return t;
+	return found;
 }
 
-int main(int argc, char **argv)
+static char *batch_output(struct batch *b, const char *path)
+{
+	const char *base = strrchr(path, '/');
+	char *out;
+
+	if (b->outdir == NULL)
+		asprintf(&out, "%s.tok", path);
+	else
+		asprintf(&out, "%s/%s.tok", b->outdir, base != NULL ? base + 1 : path);
+	return out;
+}
+
+static int name_order(const void *x, const void *y)
 {
-	struct tok_scanner s;
-	struct tok_tokenlist *list = tok_tokenlist_new();
-	struct token *t;
-	char *procpath;
-	char filename[1024] = {0};
+	return strcmp(*(char *const *)x, *(char *const *)y);
+}
 
-	init_tokens(&s.tokens);
+/*
+ * Returns -1, with a message, if two inputs would be written to the same .tok
+ * file, as a/x.c and b/x.c would be with -o.
+ */
+static int batch_check_outputs(struct batch *b, int num_files)
+{
+	char **outs = emalloc((num_files ? num_files : 1) * sizeof *outs);
+	int n = 0, i, err = 0;
 
-	s.f = fopen("input.txt", "rb");
-	if (s.f == NULL) {
-		fprintf(stderr, "No such file\n");
+	for (i = 0; i < num_files; i++)
+		if (strcmp(b->paths[i], "-") != 0)
+			outs[n++] = batch_output(b, b->paths[i]);
+	qsort(outs, n, sizeof *outs, name_order);
+	for (i = 1; i < n; i++) {
+		if (strcmp(outs[i - 1], outs[i]) == 0 && (i < 2 || strcmp(outs[i - 2], outs[i]) != 0)) {
+			fprintf(stderr, "More than one input would be written to %s\n", outs[i]);
+			err = -1;
+		}
+	}
+	for (i = 0; i < n; i++)
+		free(outs[i]);
+	free(outs);
+	return err;
+}
+
+/* Writes the tokens of the file s has mapped to f, from the cache if it has them. */
+static int batch_cached(struct batch_worker *w, struct tok_scanner *s, FILE *f)
+{
+	uint64_t keys[2] = {tok_hash(s->buf, s->len), w->b->fingerprint};
+	uint64_t key = tok_hash(keys, sizeof keys);
+	struct tok_store *st;
+	struct token t;
+	ptrdiff_t n;
+
+	if ((st = tok_cache_load(w->b->cache, key, (const char *)s->buf, s->len, s->filename)) == NULL) {
+		st = tok_store_new((const char *)s->buf, s->filename);
+		do {
+			n = tok_scan_batch(s, w->items, BATCH_ITEMS, 0);
+			for (ptrdiff_t i = 0; i < n; i++) {
+				tok_item_token(s, &w->items[i], &t);
+				tok_store_push(st, &t);
+			}
+		} while (n > 0 && w->items[n - 1].type != TOKEN_EOF);
+		if (n < 0) {
+			tok_store_free(st);
+			return -1;
+		}
+		tok_cache_save(w->b->cache, key, st, s->len, w->id);
+	}
+
+	for (ptrdiff_t i = 0; i < st->num_tokens; i++) {
+		tok_store_get(st, i, &t);
+		token_fprint(f, &t);
+	}
+	tok_store_free(st);
+	return 0;
+}
+
+static int batch_lex(struct batch_worker *w, const char *path)
+{
+	struct tok_scanner s = {0};
+	struct token t;
+	ptrdiff_t n;
+	char *out = NULL;
+	FILE *f = stdout;
+	int err;
+
+	s.dfa = w->b->dfa;
+	s.keywords = w->b->keywords;
+	s.filename = path;
+	/* A path of - is standard input, streamed to standard output as it is scanned. */
+	if (strcmp(path, "-") == 0) {
+		s.filename = "<stdin>";
+		tok_scanner_stream(&s, STDIN_FILENO);
+	} else if (tok_scanner_map(&s, path) != 0) {
+		return -1;
+	} else if ((f = fopen(out = batch_output(w->b, path), "w")) == NULL) {
+		fprintf(stderr, "Cannot write %s\n", out);
+		free(out);
+		tok_scanner_unmap(&s);
 		return -1;
 	}
 
-	asprintf(&procpath, "/proc/self/fd/%d", fileno(s.f));
-	memset(filename, 0, sizeof(filename));
-	readlink(procpath, filename, sizeof(filename) - 1);
-	free(procpath);
-	s.filename = &filename[0];
+	if (w->b->cache != NULL && out != NULL)
+		n = batch_cached(w, &s, f);
+	else
+		do {
+			n = tok_scan_batch(&s, w->items, BATCH_ITEMS, 0);
+			for (ptrdiff_t i = 0; i < n; i++) {
+				tok_item_token(&s, &w->items[i], &t);
+				token_fprint(f, &t);
+			}
+		} while (n > 0 && w->items[n - 1].type != TOKEN_EOF);
+
+	err = ferror(f);
+	if ((f == stdout ? fflush(f) : fclose(f)) != 0 || err) {
+		fprintf(stderr, "Cannot write %s\n", out != NULL ? out : "standard output");
+		n = -1;
+	}
+	if (n < 0 && out != NULL)
+		remove(out);
+
+	free(out);
+	tok_scanner_unmap(&s);
+	return n < 0 ? -1 : 0;
+}
+
+static void *batch_work(void *arg)
+{
+	struct batch_worker *w = arg;
+	int file;
 
-	while (!feof(s.f) && !ferror(s.f) && (t = get_token_nows(&s))) {
-		tok_tokenlist_push(list, t);
-		trace_tokenlist("t", list);
+	while (batch_next(w->b, w->id, &file))
+		if (batch_lex(w, w->b->paths[file]) != 0)
+			__atomic_store_n(&w->b->failed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static int batch_run(struct batch *b, int num_files)
+{
+	struct batch_worker *workers;
+	int t, i;
+
+	if (batch_check_outputs(b, num_files) != 0)
+		return 1;
+	if (b->num_threads > num_files)
+		b->num_threads = num_files;
+	if (b->num_threads < 1)
+		b->num_threads = 1;
+
+	b->queues = emalloc(b->num_threads * sizeof *b->queues);
+	workers = emalloc(b->num_threads * sizeof *workers);
+	for (t = 0; t < b->num_threads; t++) {
+		struct batch_queue *q = &b->queues[t];
+		pthread_mutex_init(&q->lock, NULL);
+		q->files = emalloc((num_files / b->num_threads + 1) * sizeof *q->files);
+		q->front = q->back = 0;
+	}
+	/* Dealt out in turn, so each thread starts with files from all over the list. */
+	for (i = 0; i < num_files; i++) {
+		struct batch_queue *q = &b->queues[i % b->num_threads];
+		q->files[q->back++] = num_files - 1 - i;
 	}
 
+	/* A worker whose thread cannot start leaves its files to be stolen, at
+	 * worst all by this thread. */
+	for (t = 0; t < b->num_threads; t++) {
+		workers[t] = (struct batch_worker){.b = b, .id = t};
+		if (t > 0)
+			workers[t].running = pthread_create(&workers[t].thread, NULL, batch_work, &workers[t]) == 0;
+	}
+	batch_work(&workers[0]);
+	for (t = 1; t < b->num_threads; t++)
+		if (workers[t].running)
+			pthread_join(workers[t].thread, NULL);
+	for (t = 0; t < b->num_threads; t++) {
+		free(b->queues[t].files);
+		pthread_mutex_destroy(&b->queues[t].lock);
+	}
+	free(workers);
+	free(b->queues);
+	if (b->cache != NULL)
+		tok_cache_evict(b->cache, b->cache_size);
+	return b->failed ? 1 : 0;
+}
+
+#ifdef MORT_STATIC_TABLES
+#define MORT_OPTIONS "j:o:c:C:"
+#define MORT_USAGE "usage: mort [-j threads] [-o dir] [-c cachedir [-C maxbytes[KMG]]] [file ...]\n"
+#else
+#define MORT_OPTIONS "j:o:c:C:d:l:"
+#define MORT_USAGE "usage: mort [-d file.dfa] [-j threads] [-o dir] [-c cachedir [-C maxbytes[KMG]]] [file ...]\n"\
+                   "       mort -l maxbytes[KMG]\n"
+#endif
+
+static void usage(void)
+{
+	fprintf(stderr, MORT_USAGE);
+	exit(2);
+}
+
+/* Reads a byte count, with an optional K, M or G suffix, into size. */
+static int parse_size(const char *arg, uint64_t *size)
+{
+	char *end;
+	int shift = 0;
+
+	/* strtoull would take a sign, and wrap a negative size. */
+	if (!isdigit((unsigned char)*arg))
+		return -1;
+	errno = 0;
+	*size = strtoull(arg, &end, 10);
+	switch (toupper((unsigned char)*end)) {
+		case 'G':
+			shift += 10;
+			/* fall through */
+		case 'M':
+			shift += 10;
+			/* fall through */
+		case 'K':
+			shift += 10;
+			end++;
+	}
+	if (*end != '\0' || errno == ERANGE || *size > UINT64_MAX >> shift)
+		return -1;
+	*size <<= shift;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct tok_scanner s = {0};
+#ifndef MORT_STATIC_TABLES
+	struct nfa_arena *arena;
+	const char *dfa_path = NULL;
+	uint64_t lazy_cap = 0;
+	int lazy = 0;
+#endif
+	struct tok_store *store;
+	struct tok_item items[MAIN_ITEMS];
+	struct token t;
+	ptrdiff_t n;
+	char filename[PATH_MAX] = {0};
+	struct batch b = {0};
+	int c;
+
+	b.num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	b.cache_size = BATCH_CACHE_SIZE;
+	while ((c = getopt(argc, argv, MORT_OPTIONS)) != -1) {
+		switch (c) {
+			case 'j':
+				b.num_threads = atoi(optarg);
+				break;
+			case 'o':
+				b.outdir = optarg;
+				break;
+			case 'c':
+				b.cache = optarg;
+				break;
+			case 'C':
+				if (parse_size(optarg, &b.cache_size) != 0)
+					usage();
+				break;
+#ifndef MORT_STATIC_TABLES
+			case 'd':
+				dfa_path = optarg;
+				break;
+			case 'l':
+				if (parse_size(optarg, &lazy_cap) != 0 || lazy_cap > SIZE_MAX)
+					usage();
+				lazy = 1;
+				break;
+#endif
+			default:
+				usage();
+		}
+	}
+
+#ifdef MORT_STATIC_TABLES
+	s.dfa = &tok_static_dfa;
+	s.keywords = &tok_static_keywords;
+#else
+	if (lazy && optind < argc) {
+		fprintf(stderr, "The lazy DFA cannot be shared by a batch\n");
+		return 1;
+	}
+	arena = init_tokens(&s.tokens);
+	if ((s.keywords = tok_keywords_new(s.tokens, NUM_TOKENS)) == NULL)
+		return 1;
+	if (lazy) {
+		s.lazy = tok_compile_lazy(s.tokens, NUM_TOKENS, s.keywords, lazy_cap);
+	} else if (dfa_path != NULL && access(dfa_path, F_OK) == 0) {
+		if ((s.dfa = dfa_load(dfa_path, NUM_TOKENS)) == NULL)
+			s.dfa = tok_compile(s.tokens, NUM_TOKENS, s.keywords, stderr);
+	} else {
+		s.dfa = tok_compile(s.tokens, NUM_TOKENS, s.keywords, stderr);
+		if (dfa_path != NULL)
+			dfa_save(s.dfa, dfa_path);
+	}
+	nfa_arena_free(arena);
+	s.tokens = NULL;
+#endif
+
+	if (optind < argc) {
+		b.paths = &argv[optind];
+		b.dfa = s.dfa;
+		b.keywords = s.keywords;
+		if (b.cache != NULL) {
+			if (mkdir(b.cache, 0777) != 0 && errno != EEXIST) {
+				fprintf(stderr, "Cannot create %s\n", b.cache);
+				return 1;
+			}
+			b.fingerprint = tok_fingerprint(b.dfa, b.keywords);
+		}
+		return batch_run(&b, argc - optind);
+	}
+
+	if (tok_scanner_map(&s, "input.txt") != 0)
+		return -1;
+
+	if (realpath("input.txt", filename) == NULL)
+		filename[0] = '\0';
+	s.filename = &filename[0];
+	store = tok_store_new((const char *)s.buf, s.filename);
+
+	do {
+		n = tok_scan_batch(&s, items, MAIN_ITEMS, TOK_SKIP_WS | TOK_SKIP_NEWLINE);
+		for (ptrdiff_t i = 0; i < n; i++) {
+			tok_item_token(&s, &items[i], &t);
+			tok_store_push(store, &t);
+			trace_store("t", store);
+		}
+	} while (n > 0 && items[n - 1].type != TOKEN_EOF);
+
+	tok_store_free(store);
+	tok_scanner_unmap(&s);
+	if (s.lazy != NULL) {
+		dfa_lazy_report(stderr, "tokens", s.lazy);
+		dfa_lazy_free(s.lazy);
+	}
 	return 0;
 }
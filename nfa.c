@@ -1,6 +1,8 @@
 #define _GNU_SOURCE
 #include <ctype.h>
+#include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,27 +10,137 @@
 #include "util.h"
 #include "nfa.h"
 
-// chemotherapy
-#define asprintf(...) asprintf((char**) __VA_ARGS__)
+// Everything a graph is built from comes out of the current arena: states in
+// chunks of contiguous storage, and graphs, names and classes from a bump
+// allocator. Freeing the arena releases a whole token set at once. With no
+// arena in use, a default one is created that is never freed. States are
+// numbered within their arena, so graphs that are combined must come from the
+// same one. Each thread has an arena of its own in use, so threads can build
+// graphs at the same time as long as they do not share an arena.
+
+#define ARENA_BLOCK_SIZE  65536
+#define ARENA_CHUNK_STATES 1024
+
+struct nfa_arena_block {
+	struct nfa_arena_block *next;
+	max_align_t data[];
+};
+
+struct nfa_arena {
+	struct nfa_arena_block *blocks;
+	char *next, *end;                       /* free space for everything else */
+	struct nfa_state *states, *states_end;  /* free space for states */
+	int32_t num_states;                     /* the id of the next state */
+};
+
+static __thread struct nfa_arena *current_arena;
+
+struct nfa_arena *
+nfa_arena_new(void)
+{
+	struct nfa_arena *arena = emalloc(sizeof *arena);
 
-static char *onechar(char c)
+	arena->blocks = NULL;
+	arena->next = arena->end = NULL;
+	arena->states = arena->states_end = NULL;
+	arena->num_states = 0;
+	return arena;
+}
+
+/* Makes arena the one graphs are allocated from, and returns the previous one. */
+struct nfa_arena *
+nfa_arena_use(struct nfa_arena *arena)
 {
-	char *s = emalloc(2);
-	s[0] = c;
-	s[1] = '\0';
+	struct nfa_arena *prev = current_arena;
+	current_arena = arena;
+	return prev;
+}
+
+void
+nfa_arena_free(struct nfa_arena *arena)
+{
+	struct nfa_arena_block *b, *next;
+
+	for (b = arena->blocks; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+	if (current_arena == arena)
+		current_arena = NULL;
+	free(arena);
+}
+
+static void *
+arena_block(struct nfa_arena *arena, size_t n)
+{
+	struct nfa_arena_block *b = emalloc(sizeof *b + n);
+
+	b->next = arena->blocks;
+	arena->blocks = b;
+	return b->data;
+}
+
+static struct nfa_arena *
+arena(void)
+{
+	if (current_arena == NULL)
+		current_arena = nfa_arena_new();
+	return current_arena;
+}
+
+void *
+nfa_alloc(size_t n)
+{
+	struct nfa_arena *a = arena();
+	void *mem;
+
+	n = (n + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+	if (n > (size_t)(a->end - a->next)) {
+		if (n > ARENA_BLOCK_SIZE / 4)
+			return arena_block(a, n);
+		a->next = arena_block(a, ARENA_BLOCK_SIZE);
+		a->end = a->next + ARENA_BLOCK_SIZE;
+	}
+	mem = a->next;
+	a->next += n;
+	return mem;
+}
+
+#ifndef NFA_NO_NAMES
+static char *
+nfa_sprintf(const char *fmt, ...)
+{
+	va_list ap;
+	char *s;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	s = nfa_alloc(n + 1);
+	va_start(ap, fmt);
+	vsnprintf(s, n + 1, fmt, ap);
+	va_end(ap);
 	return s;
 }
 
-static char *twochar(char c, char d)
+// Names are only for debugging. Building with NFA_NO_NAMES leaves them all
+// NULL without evaluating any of the arguments.
+#define setname(name, ...) ((name) = nfa_sprintf(__VA_ARGS__))
+#else
+#define setname(name, ...) ((void)sizeof(printf(__VA_ARGS__)), (name) = NULL)
+#endif
+
+static char *onechar(char c)
 {
-	char *s = emalloc(3);
+	char *s = nfa_alloc(2);
 	s[0] = c;
-	s[1] = d;
-	s[2] = '\0';
+	s[1] = '\0';
 	return s;
 }
 
-static char *
+static __attribute__((unused)) char *
 _(const char *string)
 {
 	int i;
@@ -36,10 +148,10 @@ _(const char *string)
 	char *new;
 	
 	if (string == NULL) {
-		return twochar('\xCE', '\xb5');
+		return "\xCE\xb5";
 	}
 	
-	p = new = emalloc(2 * strlen(string) + 1);
+	p = new = nfa_alloc(2 * strlen(string) + 1);
 
 	for (i = 0; string[i] != '\0'; i++) {
 		if (string[i] == '\n') {
@@ -57,7 +169,38 @@ _(const char *string)
 	}
 	*p++ = '\0';
 
-	return erealloc(new, strlen(new) + 1);
+	return new;
+}
+
+/* Every state in an arena gets a distinct id, so state lists can index arrays by it. */
+static struct nfa_state *
+newstate(void)
+{
+	struct nfa_arena *a = arena();
+	struct nfa_state *s;
+
+	if (a->states == a->states_end) {
+		a->states = arena_block(a, ARENA_CHUNK_STATES * sizeof *s);
+		a->states_end = a->states + ARENA_CHUNK_STATES;
+	}
+	s = a->states++;
+	s->id = a->num_states++;
+	s->closure = NULL;
+	s->closure_len = 0;
+	return s;
+}
+
+/* Sets bits to the bytes in chars, or every byte but those if invert is set. */
+static void
+setbits(uint64_t bits[4], const char *chars, int invert)
+{
+	uint64_t mask = invert ? ~(uint64_t)0 : 0;
+
+	bits[0] = bits[1] = bits[2] = bits[3] = mask;
+	for (; *chars != '\0'; chars++) {
+		unsigned char c = *chars;
+		bits[c >> 6] ^= (uint64_t)1 << (c & 63);
+	}
 }
 
 struct nfa_graph *
@@ -66,24 +209,26 @@ nfa_anybut(const char *invalid)
 	struct nfa_state *f, *q;
 	struct nfa_graph *g;
 
-	f = emalloc(sizeof *f);
-	asprintf(&f->name, "(always-f)");
+	f = newstate();
+	setname(f->name, "(always-f)");
 	f->trans1.endpoint = NULL;
 	f->trans1.valid = NULL;
 	f->trans2.endpoint = NULL;
 	f->trans2.valid = NULL;
 
-	q = emalloc(sizeof *q);
-	asprintf(&q->name, "(always-q)");
+	q = newstate();
+	setname(q->name, "(always-q)");
 	q->trans1.endpoint = NULL;
 	q->trans1.valid = invalid;
 	q->trans2.endpoint = f;
 	q->trans2.valid = "";
+	setbits(q->trans2.bits, invalid, 1);
 
-	g = emalloc(sizeof *g);
-	asprintf(&g->name, "[^%s]", _(invalid));
+	g = nfa_alloc(sizeof *g);
+	setname(g->name, "[^%s]", _(invalid));
 	g->initial_state = q;
 	g->final_state = f;
+	g->num_ids = q->id + 1;
 
 	return g;
 }
@@ -94,24 +239,25 @@ nfa_never(void)
 	struct nfa_state *f, *q;
 	struct nfa_graph *g;
 
-	f = emalloc(sizeof *f);
-	asprintf(&f->name, "nfa_never final");
+	f = newstate();
+	setname(f->name, "nfa_never final");
 	f->trans1.endpoint = NULL;
 	f->trans1.valid = NULL;
 	f->trans2.endpoint = NULL;
 	f->trans2.valid = NULL;
 
-	q = emalloc(sizeof *q);
-	asprintf(&q->name, "nfa_never initial");
+	q = newstate();
+	setname(q->name, "nfa_never initial");
 	q->trans1.endpoint = NULL;
 	q->trans1.valid = NULL;
 	q->trans2.endpoint = NULL;
 	q->trans2.valid = NULL;
 
-	g = emalloc(sizeof *g);
-	asprintf(&g->name, "[^]");
+	g = nfa_alloc(sizeof *g);
+	setname(g->name, "[^]");
 	g->initial_state = q;
 	g->final_state = f;
+	g->num_ids = q->id + 1;
 
 	return g;
 }
@@ -122,24 +268,27 @@ nfa_symbol(const char *valid)
 	struct nfa_state *f, *q;
 	struct nfa_graph *graph;
 
-	f = emalloc(sizeof *f);
-	asprintf(&f->name, "nfa_symbol /[%s]/ final", _(valid));
+	f = newstate();
+	setname(f->name, "nfa_symbol /[%s]/ final", _(valid));
 	f->trans1.endpoint = NULL;
 	f->trans1.valid = NULL;
 	f->trans2.endpoint = NULL;
 	f->trans2.valid = NULL;
 
-	q = emalloc(sizeof *q);
-	asprintf(&q->name, "nfa_symbol /[%s]/ initial", _(valid));
+	q = newstate();
+	setname(q->name, "nfa_symbol /[%s]/ initial", _(valid));
 	q->trans1.endpoint = f;
 	q->trans1.valid = valid;
+	if (valid != NULL)
+		setbits(q->trans1.bits, valid, 0);
 	q->trans2.endpoint = NULL;
 	q->trans2.valid = NULL;
 
-	graph = emalloc(sizeof *graph);
-	asprintf(&graph->name, "[%s]", _(valid));
+	graph = nfa_alloc(sizeof *graph);
+	setname(graph->name, "[%s]", _(valid));
 	graph->initial_state = q;
 	graph->final_state = f;
+	graph->num_ids = q->id + 1;
 
 	return graph;
 }
@@ -155,20 +304,20 @@ nfa_string(const char *string)
 	i = 0;
 	n = strlen(string);
 
-	state = emalloc(sizeof *state);
-	asprintf(&state->name, "nfa_string /%s/ initial", _(string));
+	state = newstate();
+	setname(state->name, "nfa_string /%s/ initial", _(string));
 	state->trans1.endpoint = NULL;
 	state->trans1.valid = NULL;
 	state->trans2.endpoint = NULL;
 	state->trans2.valid = NULL;
 
-	graph = emalloc(sizeof *graph);
-	asprintf(&graph->name, "%s", _(string));
+	graph = nfa_alloc(sizeof *graph);
+	setname(graph->name, "%s", _(string));
 	graph->initial_state = state;
 
 	while ((c = *string++) != '\0') {
-		struct nfa_state *new = emalloc(sizeof *new);
-		asprintf(&new->name, "nfa_string /%s/ %d of %d", _(string), i, n);
+		struct nfa_state *new = newstate();
+		setname(new->name, "nfa_string /%s/ %d of %d", _(string), i, n);
 		new->trans1.endpoint = NULL;
 		new->trans1.valid = NULL;
 		new->trans2.endpoint = NULL;
@@ -176,12 +325,14 @@ nfa_string(const char *string)
 
 		state->trans1.endpoint = new;
 		state->trans1.valid = onechar(c);
+		setbits(state->trans1.bits, state->trans1.valid, 0);
 
 		state = new;
 		i++;
 	}
 
 	graph->final_state = state;
+	graph->num_ids = state->id + 1;
 
 	return graph;
 }
@@ -198,14 +349,14 @@ nfa_union(struct nfa_graph *s, struct nfa_graph *t)
 	struct nfa_state *f, *q;
 	struct nfa_graph *graph;
 
-	f = emalloc(sizeof *f);
+	f = newstate();
 	f->name = "nfa_union final";
 	f->trans1.endpoint = NULL;
 	f->trans1.valid = NULL;
 	f->trans2.endpoint = NULL;
 	f->trans2.valid = NULL;
 
-	q = emalloc(sizeof *q);
+	q = newstate();
 	q->name = "nfa_union initial";
 	q->trans1.endpoint = s->initial_state;
 	q->trans1.valid = NULL;
@@ -218,10 +369,11 @@ nfa_union(struct nfa_graph *s, struct nfa_graph *t)
 	t->final_state->trans1.endpoint = f;
 	t->final_state->trans1.valid = NULL;
 
-	graph = emalloc(sizeof *graph);
-	asprintf(&graph->name, "(%s|%s)", s->name, t->name);
+	graph = nfa_alloc(sizeof *graph);
+	setname(graph->name, "(%s|%s)", s->name, t->name);
 	graph->initial_state = q;
 	graph->final_state = f;
+	graph->num_ids = q->id + 1;
 
 	return graph;
 }
@@ -236,10 +388,11 @@ nfa_concat(struct nfa_graph *s, struct nfa_graph *t)
 	s->final_state->trans1.endpoint = t->initial_state;
 	s->final_state->trans1.valid = NULL;
 
-	graph = emalloc(sizeof *graph);
-	asprintf(&graph->name, "%s%s", s->name, t->name);
+	graph = nfa_alloc(sizeof *graph);
+	setname(graph->name, "%s%s", s->name, t->name);
 	graph->initial_state = s->initial_state;
 	graph->final_state = t->final_state;
+	graph->num_ids = s->num_ids > t->num_ids ? s->num_ids : t->num_ids;
 
 	return graph;
 }
@@ -250,7 +403,7 @@ nfa_kleene_star(struct nfa_graph *g)
 	struct nfa_state *f, *q;
 	struct nfa_graph *graph;
 
-	f = emalloc(sizeof *f);
+	f = newstate();
 	f->name = "nfa_kleene_star final";
 	f->trans1.endpoint = NULL;
 	f->trans1.valid = NULL;
@@ -262,21 +415,28 @@ nfa_kleene_star(struct nfa_graph *g)
 	g->final_state->trans2.endpoint = f;
 	g->final_state->trans2.valid = NULL;
 
-	q = emalloc(sizeof *q);
+	q = newstate();
 	q->name = "nfa_kleene_star initial";
 	q->trans1.endpoint = g->initial_state;
 	q->trans1.valid = NULL;
 	q->trans2.endpoint = f;
 	q->trans2.valid = NULL;
 
-	graph = emalloc(sizeof *graph);
-	asprintf(&graph->name, "(%s)*", g->name);
+	graph = nfa_alloc(sizeof *graph);
+	setname(graph->name, "(%s)*", g->name);
 	graph->initial_state = q;
 	graph->final_state = f;
+	graph->num_ids = q->id + 1;
 
 	return graph;
 }
 
+// State lists are sparse sets: sparse[s->id] is where s would be in states, so
+// membership is a bounds check and a comparison, and clearing is O(1). sparse
+// is never initialised; a stale or garbage entry fails the comparison. It is
+// sized for the ids of the graphs the list is for, and grows if a state beyond
+// them is pushed.
+
 void
 nfa_statelist_expand(struct nfa_statelist *list)
 {
@@ -284,13 +444,26 @@ nfa_statelist_expand(struct nfa_statelist *list)
 	list->capacity *= 2;
 }
 
+static void
+nfa_statelist_expand_ids(struct nfa_statelist *list, int32_t id)
+{
+	int32_t n = 2 * list->num_ids;
+
+	if (n <= id)
+		n = id + 1;
+	list->sparse = erealloc(list->sparse, n * sizeof *list->sparse);
+	list->num_ids = n;
+}
+
 int
 nfa_statelist_contains(struct nfa_statelist *list, struct nfa_state *s)
 {
-	for (ptrdiff_t i = 0; i < list->num_states; i++)
-		if (list->states[i] == s)
-			return 1;
-	return 0;
+	uint32_t i;
+
+	if (s->id >= list->num_ids)
+		return 0;
+	i = list->sparse[s->id];
+	return i < list->num_states && list->states[i] == s;
 }
 
 void
@@ -299,13 +472,24 @@ nfa_statelist_push(struct nfa_statelist *list, struct nfa_state *s)
 	if (list->num_states >= list->capacity) {
 		nfa_statelist_expand(list);
 	}
+	if (s->id >= list->num_ids) {
+		nfa_statelist_expand_ids(list, s->id);
+	}
 
+	list->sparse[s->id] = list->num_states;
 	list->states[list->num_states++] = s;
 }
 
 void
 nfa_statelist_pushclosure(struct nfa_statelist *list, struct nfa_state *s)
 {
+	if (s->closure != NULL) {
+		for (int32_t i = 0; i < s->closure_len; i++)
+			if (!nfa_statelist_contains(list, s->closure[i]))
+				nfa_statelist_push(list, s->closure[i]);
+		return;
+	}
+
 	nfa_statelist_push(list, s);
 	if (s->trans1.endpoint != NULL && s->trans1.valid == NULL)
 		if (!nfa_statelist_contains(list, s->trans1.endpoint))
@@ -315,33 +499,75 @@ nfa_statelist_pushclosure(struct nfa_statelist *list, struct nfa_state *s)
 			nfa_statelist_pushclosure(list, s->trans2.endpoint);
 }
 
+/* Leaves in list every state reachable from s, or only by epsilon transitions. */
 void
-nfa_statelist_pushmatching(struct nfa_statelist *list, struct nfa_state *s, char c)
+nfa_statelist_reachable(struct nfa_statelist *list, struct nfa_state *s, int epsilon_only)
 {
-	if (s->trans1.endpoint == NULL && s->trans2.endpoint != NULL && s->trans1.valid != NULL)
-		if (strchr(s->trans1.valid, c) == NULL)
-			if (!nfa_statelist_contains(list, s->trans2.endpoint))
-				nfa_statelist_pushclosure(list, s->trans2.endpoint);
+	nfa_statelist_clear(list);
+	nfa_statelist_push(list, s);
+	for (ptrdiff_t i = 0; i < list->num_states; i++) {
+		struct nfa_state *t = list->states[i];
+		if (t->trans1.endpoint != NULL && (!epsilon_only || t->trans1.valid == NULL))
+			if (!nfa_statelist_contains(list, t->trans1.endpoint))
+				nfa_statelist_push(list, t->trans1.endpoint);
+		if (t->trans2.endpoint != NULL && (!epsilon_only || t->trans2.valid == NULL))
+			if (!nfa_statelist_contains(list, t->trans2.endpoint))
+				nfa_statelist_push(list, t->trans2.endpoint);
+	}
+}
 
-	if (s->trans1.endpoint != NULL && s->trans1.valid != NULL)
-		if (strchr(s->trans1.valid, c) != NULL)
-			if (!nfa_statelist_contains(list, s->trans1.endpoint))
-				nfa_statelist_pushclosure(list, s->trans1.endpoint);
+/*
+ * Precomputes the epsilon closure of every state in g, all in one block, so
+ * that pushing a closure is a loop over a list rather than a recursive walk.
+ * g must be complete: the closures are not updated if g is later combined with
+ * another graph.
+ */
+void
+nfa_graph_closures(struct nfa_graph *g)
+{
+	struct nfa_statelist *states = nfa_statelist_new(g->num_ids);
+	struct nfa_statelist *closure = nfa_statelist_new(g->num_ids);
+	struct nfa_state **block, **closures;
+	ptrdiff_t *offsets;
+	ptrdiff_t i, n = 0;
+
+	nfa_statelist_reachable(states, g->initial_state, 0);
+	offsets = emalloc((states->num_states + 1) * sizeof *offsets);
+	block = emalloc(sizeof *block);
+
+	for (i = 0; i < states->num_states; i++) {
+		nfa_statelist_reachable(closure, states->states[i], 1);
+		block = erealloc(block, (n + closure->num_states) * sizeof *block);
+		memcpy(&block[n], closure->states, closure->num_states * sizeof *block);
+		offsets[i] = n;
+		n += closure->num_states;
+	}
+	offsets[i] = n;
+
+	closures = nfa_alloc(n * sizeof *closures);
+	memcpy(closures, block, n * sizeof *closures);
+	for (i = 0; i < states->num_states; i++) {
+		states->states[i]->closure = &closures[offsets[i]];
+		states->states[i]->closure_len = offsets[i + 1] - offsets[i];
+	}
 
-	if (s->trans2.endpoint != NULL && s->trans2.valid != NULL)
-		if (strchr(s->trans2.valid, c) != NULL)
-			if (!nfa_statelist_contains(list, s->trans2.endpoint))
-				nfa_statelist_pushclosure(list, s->trans2.endpoint);
+	free(block);
+	free(offsets);
+	nfa_statelist_free(states);
+	nfa_statelist_free(closure);
 }
 
+/* Returns an empty list, with room for states with ids below num_ids. */
 struct nfa_statelist *
-nfa_statelist_new(void)
+nfa_statelist_new(int32_t num_ids)
 {
 	struct nfa_statelist *list = emalloc(sizeof *list);
 
 	list->states = emalloc(sizeof(struct nfa_state *));
 	list->num_states = 0;
 	list->capacity = 1;
+	list->num_ids = num_ids > 0 ? num_ids : 1;
+	list->sparse = emalloc(list->num_ids * sizeof *list->sparse);
 
 	return list;
 }
@@ -351,3 +577,190 @@ nfa_statelist_clear(struct nfa_statelist *list)
 {
 	list->num_states = 0;
 }
+
+void
+nfa_statelist_free(struct nfa_statelist *list)
+{
+	free(list->states);
+	free(list->sparse);
+	free(list);
+}
+
+// The compact form of a set of finished graphs: states are indices into one
+// array, transitions refer to a table of distinct classes, and the epsilon
+// closures are precomputed, so a state costs 16 bytes and holds no pointers.
+// Names are kept to one side for debugging. It is allocated from the current
+// arena, like the graphs themselves.
+
+static int32_t
+intern_class(uint64_t (*classes)[4], int32_t *num_classes, const uint64_t bits[4])
+{
+	for (int32_t i = 0; i < *num_classes; i++)
+		if (memcmp(classes[i], bits, sizeof classes[i]) == 0)
+			return i;
+	memcpy(classes[*num_classes], bits, sizeof classes[*num_classes]);
+	return (*num_classes)++;
+}
+
+struct nfa_compact *
+nfa_freeze(struct nfa_graph **graphs, int n)
+{
+	struct nfa_statelist *all, *reach;
+	struct nfa_compact *c = nfa_alloc(sizeof *c);
+	struct nfa_indexset *set;
+	uint64_t (*classes)[4];
+	int32_t num_classes = 0, num_ids = 0;
+	ptrdiff_t total = 0;
+	int32_t i, k;
+
+	for (k = 0; k < n; k++)
+		if (graphs[k]->num_ids > num_ids)
+			num_ids = graphs[k]->num_ids;
+	all = nfa_statelist_new(num_ids);
+	reach = nfa_statelist_new(num_ids);
+
+	for (k = 0; k < n; k++) {
+		nfa_statelist_reachable(reach, graphs[k]->initial_state, 0);
+		for (ptrdiff_t j = 0; j < reach->num_states; j++)
+			if (!nfa_statelist_contains(all, reach->states[j]))
+				nfa_statelist_push(all, reach->states[j]);
+		/* nfa_never's final state cannot be reached, but it still needs an index. */
+		if (!nfa_statelist_contains(all, graphs[k]->final_state))
+			nfa_statelist_push(all, graphs[k]->final_state);
+	}
+
+	c->num_states = all->num_states;
+	c->num_graphs = n;
+	c->states = nfa_alloc(c->num_states * sizeof *c->states);
+	c->names = nfa_alloc(c->num_states * sizeof *c->names);
+	c->accepts = nfa_alloc(c->num_states * sizeof *c->accepts);
+	c->initial = nfa_alloc(n * sizeof *c->initial);
+	classes = emalloc((2 * c->num_states + 1) * sizeof *classes);
+
+	for (i = 0; i < c->num_states; i++) {
+		struct nfa_state *s = all->states[i];
+		struct nfa_trans *trans[2] = {&s->trans1, &s->trans2};
+
+		for (int j = 0; j < 2; j++) {
+			if (trans[j]->endpoint == NULL) {
+				c->states[i].next[j] = -1;
+				c->states[i].cls[j] = -1;
+				continue;
+			}
+			c->states[i].next[j] = all->sparse[trans[j]->endpoint->id];
+			if (trans[j]->valid == NULL)
+				c->states[i].cls[j] = -1;
+			else
+				c->states[i].cls[j] = intern_class(classes, &num_classes, trans[j]->bits);
+		}
+		c->names[i] = s->name;
+		c->accepts[i] = -1;
+	}
+	for (k = n - 1; k >= 0; k--) {
+		c->initial[k] = all->sparse[graphs[k]->initial_state->id];
+		c->accepts[all->sparse[graphs[k]->final_state->id]] = k;
+	}
+
+	c->num_classes = num_classes;
+	c->classes = nfa_alloc((num_classes ? num_classes : 1) * sizeof *c->classes);
+	memcpy(c->classes, classes, num_classes * sizeof *classes);
+	free(classes);
+
+	/* Closures are found by walking epsilon transitions in the compact form. */
+	set = nfa_indexset_new(c->num_states);
+	c->closure_start = nfa_alloc((c->num_states + 1) * sizeof *c->closure_start);
+	for (int pass = 0; pass < 2; pass++) {
+		total = 0;
+		for (i = 0; i < c->num_states; i++) {
+			set->num = 0;
+			set->sparse[i] = 0;
+			set->dense[set->num++] = i;
+			for (int32_t j = 0; j < set->num; j++) {
+				struct nfa_cstate *t = &c->states[set->dense[j]];
+				for (int e = 0; e < 2; e++) {
+					if (t->next[e] < 0 || t->cls[e] >= 0 || nfa_indexset_contains(set, t->next[e]))
+						continue;
+					set->sparse[t->next[e]] = set->num;
+					set->dense[set->num++] = t->next[e];
+				}
+			}
+			if (pass == 1)
+				memcpy(&c->closure[total], set->dense, set->num * sizeof *set->dense);
+			c->closure_start[i] = total;
+			total += set->num;
+		}
+		c->closure_start[i] = total;
+		if (pass == 0)
+			c->closure = nfa_alloc((total ? total : 1) * sizeof *c->closure);
+	}
+
+	nfa_indexset_free(set);
+	nfa_statelist_free(all);
+	nfa_statelist_free(reach);
+	return c;
+}
+
+// Index sets are the sparse sets of the compact form. As with state lists,
+// sparse is never initialised.
+
+struct nfa_indexset *
+nfa_indexset_new(int32_t size)
+{
+	struct nfa_indexset *set = emalloc(sizeof *set);
+
+	set->dense = emalloc((size ? size : 1) * sizeof *set->dense);
+	set->sparse = emalloc((size ? size : 1) * sizeof *set->sparse);
+	set->num = 0;
+	return set;
+}
+
+static int
+compare_indices(const void *a, const void *b)
+{
+	int32_t x = *(const int32_t *)a;
+	int32_t y = *(const int32_t *)b;
+	return (x > y) - (x < y);
+}
+
+void
+nfa_indexset_sort(struct nfa_indexset *set)
+{
+	qsort(set->dense, set->num, sizeof *set->dense, compare_indices);
+	for (int32_t i = 0; i < set->num; i++)
+		set->sparse[set->dense[i]] = i;
+}
+
+void
+nfa_indexset_free(struct nfa_indexset *set)
+{
+	free(set->dense);
+	free(set->sparse);
+	free(set);
+}
+
+void
+nfa_compact_pushclosure(const struct nfa_compact *c, struct nfa_indexset *set, int32_t s)
+{
+	for (int32_t i = c->closure_start[s]; i < c->closure_start[s + 1]; i++) {
+		int32_t t = c->closure[i];
+		if (!nfa_indexset_contains(set, t)) {
+			set->sparse[t] = set->num;
+			set->dense[set->num++] = t;
+		}
+	}
+}
+
+/* Adds to to the closure of every state reached from from on byte. */
+void
+nfa_compact_step(const struct nfa_compact *c, const struct nfa_indexset *from, struct nfa_indexset *to, unsigned char byte)
+{
+	for (int32_t i = 0; i < from->num; i++) {
+		const struct nfa_cstate *s = &c->states[from->dense[i]];
+		for (int j = 0; j < 2; j++) {
+			int32_t k = s->cls[j];
+			if (k >= 0 && ((c->classes[k][byte >> 6] >> (byte & 63)) & 1))
+				if (!nfa_indexset_contains(to, s->next[j]))
+					nfa_compact_pushclosure(c, to, s->next[j]);
+		}
+	}
+}
@@ -2,16 +2,27 @@ struct nfa_graph {
 	struct nfa_state *initial_state;
 	struct nfa_state *final_state;
 	const char *name; /* lifetime should be managed separately from this object */
+	int32_t num_ids;  /* above the id of every state in the graph */
 };
 struct nfa_trans {
-	const char *valid;
+	const char *valid;     /* NULL for an epsilon transition */
 	struct nfa_state *endpoint;
+	uint64_t bits[4];      /* bytes accepted, precomputed from valid */
 };
+#define nfa_trans_matches(t, c) (((t)->bits[(unsigned char)(c) >> 6] >> ((unsigned char)(c) & 63)) & 1)
 struct nfa_state {
 	struct nfa_trans trans1;
 	struct nfa_trans trans2;
 	const char *name; /* lifetime should be managed separately from this object */
+	int32_t id;       /* distinct among the states of an arena, counting up from 0 */
+	struct nfa_state **closure; /* epsilon closure, from nfa_graph_closures, or NULL */
+	int32_t closure_len;
 };
+struct nfa_arena;
+extern struct nfa_arena *nfa_arena_new(void);
+extern struct nfa_arena *nfa_arena_use(struct nfa_arena *arena);
+extern void nfa_arena_free(struct nfa_arena *arena);
+extern void *nfa_alloc(size_t n);
 extern struct nfa_graph *nfa_never(void);
 extern struct nfa_graph *nfa_anybut(const char *invalid);
 extern struct nfa_graph *nfa_symbol(const char *valid);
@@ -20,18 +31,50 @@ extern struct nfa_graph *nfa_epsilon(void);
 extern struct nfa_graph *nfa_union(struct nfa_graph *s, struct nfa_graph *t);
 extern struct nfa_graph *nfa_concat(struct nfa_graph *s, struct nfa_graph *t);
 extern struct nfa_graph *nfa_kleene_star(struct nfa_graph *g);
+extern void nfa_graph_closures(struct nfa_graph *g);
 struct nfa_statelist {
 	struct nfa_state **states;
 	ptrdiff_t num_states;
 	ptrdiff_t capacity;
+	int32_t *sparse;  /* position in states of each state, by id */
+	int32_t num_ids;
 };
-extern struct nfa_statelist *nfa_statelist_new(void);
+extern struct nfa_statelist *nfa_statelist_new(int32_t num_ids);
 extern void nfa_statelist_push(struct nfa_statelist *, struct nfa_state *);
 extern void nfa_statelist_pushclosure(struct nfa_statelist *, struct nfa_state *);
-extern void nfa_statelist_pushmatching(struct nfa_statelist *, struct nfa_state *, char c);
 extern int nfa_statelist_contains(struct nfa_statelist *, struct nfa_state *);
 extern void nfa_statelist_expand(struct nfa_statelist *);
 extern void nfa_statelist_clear(struct nfa_statelist *);
+extern void nfa_statelist_reachable(struct nfa_statelist *, struct nfa_state *, int epsilon_only);
+extern void nfa_statelist_free(struct nfa_statelist *);
+struct nfa_cstate {
+	int32_t next[2];  /* endpoint of each transition, or -1 */
+	int32_t cls[2];   /* class of each transition, or -1 for epsilon */
+};
+struct nfa_compact {
+	struct nfa_cstate *states;
+	int32_t num_states;
+	uint64_t (*classes)[4];  /* shared by every transition on the same bytes */
+	int32_t num_classes;
+	int32_t *closure_start;  /* closure of state i is closure[closure_start[i]..closure_start[i + 1]) */
+	int32_t *closure;
+	int32_t *initial;        /* initial state of each graph */
+	int32_t *accepts;        /* first graph each state is the final state of, or -1 */
+	int num_graphs;
+	const char **names;      /* debug name of each state */
+};
+extern struct nfa_compact *nfa_freeze(struct nfa_graph **graphs, int n);
+struct nfa_indexset {
+	int32_t *dense;
+	int32_t *sparse;
+	int32_t num;
+};
+#define nfa_indexset_contains(set, s) ((uint32_t)(set)->sparse[s] < (uint32_t)(set)->num && (set)->dense[(set)->sparse[s]] == (s))
+extern struct nfa_indexset *nfa_indexset_new(int32_t size);
+extern void nfa_indexset_sort(struct nfa_indexset *set);
+extern void nfa_indexset_free(struct nfa_indexset *set);
+extern void nfa_compact_pushclosure(const struct nfa_compact *c, struct nfa_indexset *set, int32_t s);
+extern void nfa_compact_step(const struct nfa_compact *c, const struct nfa_indexset *from, struct nfa_indexset *to, unsigned char byte);
 #define trace_statelist_abbrev(code, list)\
 	do {\
 		struct nfa_statelist *_l = (list);\
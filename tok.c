@@ -1,8 +1,19 @@
 #define _GNU_SOURCE
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "util.h"
 #include "tok.h"
@@ -119,46 +130,470 @@ char *token_stringify(struct token *t)
 	char *result;
 	const char *name = token_name(t->type);
 	if (is_variable_content_token(t->type))
-		asprintf(&result, "%d:%d:%s:%s", t->line, t->col, name, t->string);
+		asprintf(&result, "%d:%d:%s:%.*s", t->line, t->col, name, (int)t->length, t->text);
 	else
 		asprintf(&result, "%d:%d:%s", t->line, t->col, name);
 	return result;
 }
 
-struct tok_tokenlist *tok_tokenlist_new(void)
+/* Writes t to f on a line of its own, as token_stringify would format it. */
+void token_fprint(FILE *f, const struct token *t)
 {
-	struct tok_tokenlist *list = emalloc(sizeof *list);
+	const char *name = token_name(t->type);
+	if (is_variable_content_token(t->type))
+		fprintf(f, "%d:%d:%s:%.*s\n", t->line, t->col, name, (int)t->length, t->text);
+	else
+		fprintf(f, "%d:%d:%s\n", t->line, t->col, name);
+}
 
-	list->tokens = emalloc(sizeof(struct token));
-	list->num_tokens = 0;
-	list->capacity = 1;
+// Tokens scanned from a buffer only refer to their lexeme, which stays valid as
+// long as the buffer does. This copies it out for consumers that need a string
+// of their own, once; the token owns the copy.
+char *token_materialize(struct token *t)
+{
+	if (t->string == NULL) {
+		t->string = emalloc(t->length + 1);
+		memcpy(t->string, t->text, t->length);
+		t->string[t->length] = '\0';
+	}
+	return t->string;
+}
 
-	return list;
+// Tokens are kept column by column, so that a pass over just their types reads
+// a dense array of bytes. The columns grow a chunk at a time and chunks never
+// move, so appending is constant time and needs no allocation per token. The
+// text of a token is not copied: it is found at its offset in the source.
+
+struct tok_store *tok_store_new(const char *source, const char *filename)
+{
+	struct tok_store *st = emalloc(sizeof *st);
+
+	*st = (struct tok_store){.chunks = NULL, .num_chunks = 0, .chunks_capacity = 0, .num_tokens = 0,
+	    .source = source, .filename = filename};
+	return st;
 }
 
-void tok_tokenlist_push(struct tok_tokenlist *list, struct token *t)
+static void store_grow(struct tok_store *st)
 {
-	if (list->num_tokens >= list->capacity)
-		tok_tokenlist_expand(list);
+	if (st->num_chunks == st->chunks_capacity) {
+		st->chunks_capacity = st->chunks_capacity ? 2 * st->chunks_capacity : 16;
+		st->chunks = erealloc(st->chunks, st->chunks_capacity * sizeof *st->chunks);
+	}
+	st->chunks[st->num_chunks++] = emalloc(sizeof **st->chunks);
+}
 
-	list->tokens[list->num_tokens++] = t;
+void tok_store_push(struct tok_store *st, const struct token *t)
+{
+	ptrdiff_t c = st->num_tokens >> TOK_STORE_SHIFT;
+	ptrdiff_t k = st->num_tokens & (TOK_STORE_CHUNK - 1);
+	struct tok_store_chunk *chunk;
+
+	if (c == st->num_chunks)
+		store_grow(st);
+	chunk = st->chunks[c];
+	chunk->type[k] = t->type;
+	chunk->length[k] = t->length;
+	chunk->line[k] = t->line;
+	chunk->col[k] = t->col;
+	chunk->offset[k] = t->offset;
+	st->num_tokens++;
 }
 
-int tok_tokenlist_contains(struct tok_tokenlist *list, struct token *t)
+/* Fills in t from the i-th token, its text pointing into the source. */
+void tok_store_get(const struct tok_store *st, ptrdiff_t i, struct token *t)
 {
-	for (ptrdiff_t i = 0; i < list->num_tokens; i++)
-		if (list->tokens[i] == t)
-			return 1;
+	const struct tok_store_chunk *chunk = st->chunks[i >> TOK_STORE_SHIFT];
+	ptrdiff_t k = i & (TOK_STORE_CHUNK - 1);
+
+	*t = (struct token){.type = chunk->type[k], .string = NULL, .text = st->source + chunk->offset[k],
+	    .offset = chunk->offset[k], .length = chunk->length[k], .filename = st->filename, .line = chunk->line[k],
+	    .col = chunk->col[k]};
+}
+
+/* Empties the store, keeping its chunks for the next tokens. */
+void tok_store_clear(struct tok_store *st)
+{
+	st->num_tokens = 0;
+}
+
+void tok_store_free(struct tok_store *st)
+{
+	for (ptrdiff_t c = 0; c < st->num_chunks; c++)
+		free(st->chunks[c]);
+	free(st->chunks);
+	free(st);
+}
+
+// A store can be saved to a file and loaded back instead of lexing the source
+// again, as long as the source is unchanged: the header records a hash of it.
+// After the header come the types, a byte each, then four unsigned LEB128
+// varints per token: the gap between the end of the previous token and its
+// offset, its length, how many lines it is below the previous one, and its
+// column, less the previous token's if they are on the same line. Tokens are
+// mostly short and on the same line as the last, so most take five bytes.
+
+#define TOK_FILE_MAGIC "MORTTOK"
+#define TOK_FILE_VERSION 1
+
+struct tok_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t source_hash;
+	uint64_t source_size;
+	uint64_t num_tokens;
+	uint32_t num_types;  /* NUM_TOKENS when written, so renumbered types are rejected */
+	uint32_t unused;
+	uint64_t deltas_offset;
+	uint64_t size;
+};
+
+static uint64_t rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t hash_word(uint64_t h, uint64_t w)
+{
+	w *= 0x87c37b91114253d5;
+	w = rotl(w, 31) * 0x4cf5ad432745937f;
+	return rotl(h ^ w, 27) * 5 + 0x52dce729;
+}
+
+/* A fast hash of the len bytes at data, eight at a time, not for adversaries. */
+uint64_t tok_hash(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t h = 0x9e3779b97f4a7c15 ^ len;
+	uint64_t w;
+	size_t n = len;
+
+	for (; n >= 8; p += 8, n -= 8) {
+		memcpy(&w, p, 8);
+		h = hash_word(h, w);
+	}
+	if (n > 0) {
+		w = 0;
+		memcpy(&w, p, n);
+		h = hash_word(h, w);
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53;
+	return h ^ (h >> 33);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+/* Returns NULL if the varint runs past end. */
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+	uint64_t x = 0;
+
+	/* Most are a single byte. */
+	if (p < end && *p < 0x80) {
+		*v = *p;
+		return p + 1;
+	}
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		x |= (uint64_t)(*p & 0x7f) << shift;
+		if (*p++ < 0x80) {
+			*v = x;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Writes st to path for source whose tok_hash is hash and which is size bytes
+ * long. Returns -1 if it cannot be written.
+ */
+int tok_store_save(const struct tok_store *st, const char *path, uint64_t hash, size_t size)
+{
+	struct tok_file_header h;
+	uint8_t *deltas = emalloc(TOK_STORE_CHUNK * 4 * 10);
+	ptrdiff_t num_chunks = (st->num_tokens + TOK_STORE_CHUNK - 1) >> TOK_STORE_SHIFT;
+	size_t end = 0;
+	int line = 1, col = 1;
+	int ok;
+	FILE *f;
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, TOK_FILE_MAGIC, sizeof TOK_FILE_MAGIC);
+	h.version = TOK_FILE_VERSION;
+	h.byte_order = 0x01020304;
+	h.source_hash = hash;
+	h.source_size = size;
+	h.num_tokens = st->num_tokens;
+	h.num_types = NUM_TOKENS;
+	h.deltas_offset = sizeof h + st->num_tokens;
+	h.size = h.deltas_offset;
+
+	if ((f = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "Cannot open %s for writing\n", path);
+		free(deltas);
+		return -1;
+	}
+
+	/* The types are already laid out as in the file, a chunk at a time. */
+	ok = fwrite(&h, sizeof h, 1, f) == 1;
+	for (ptrdiff_t c = 0; ok && c < num_chunks; c++) {
+		size_t n = c < num_chunks - 1 ? TOK_STORE_CHUNK : st->num_tokens - (c << TOK_STORE_SHIFT);
+		ok = fwrite(st->chunks[c]->type, 1, n, f) == n;
+	}
+	for (ptrdiff_t c = 0; ok && c < num_chunks; c++) {
+		const struct tok_store_chunk *chunk = st->chunks[c];
+		size_t n = c < num_chunks - 1 ? TOK_STORE_CHUNK : st->num_tokens - (c << TOK_STORE_SHIFT);
+		uint8_t *q = deltas;
+
+		for (size_t k = 0; k < n; k++) {
+			q = put_varint(q, chunk->offset[k] - end);
+			q = put_varint(q, chunk->length[k]);
+			q = put_varint(q, chunk->line[k] - line);
+			q = put_varint(q, chunk->line[k] == line ? chunk->col[k] - col : chunk->col[k]);
+			end = chunk->offset[k] + chunk->length[k];
+			line = chunk->line[k];
+			col = chunk->col[k];
+		}
+		ok = fwrite(deltas, 1, q - deltas, f) == (size_t)(q - deltas);
+		h.size += q - deltas;
+	}
+	/* Only now is the size known. */
+	ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof h, 1, f) == 1;
+	free(deltas);
+
+	if (fclose(f) != 0 || !ok) {
+		fprintf(stderr, "Cannot write %s\n", path);
+		return -1;
+	}
 	return 0;
 }
 
-void tok_tokenlist_expand(struct tok_tokenlist *list)
+/*
+ * Maps a file written by tok_store_save and decodes it into a store over the
+ * size bytes at source, which must be what the file was written for. Returns
+ * NULL if there is no such file or it is for a different hash or size; a file
+ * that is not a token file, or is damaged, is also reported.
+ */
+struct tok_store *tok_store_load(const char *path, uint64_t hash, const char *source, size_t size,
+    const char *filename)
 {
-	list->tokens = erealloc(list->tokens, 2 * list->capacity * sizeof(struct token *));
-	list->capacity *= 2;
+	const struct tok_file_header *h;
+	const uint8_t *types, *p, *end;
+	struct tok_store *st;
+	struct stat sb;
+	void *map;
+	uint64_t gap, length, dline, dcol;
+	size_t last = 0;
+	int line = 1, col = 1;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		if (errno != ENOENT)
+			fprintf(stderr, "Cannot open %s\n", path);
+		return NULL;
+	}
+	if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof *h) {
+		fprintf(stderr, "%s is not a token file\n", path);
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Cannot map %s\n", path);
+		return NULL;
+	}
+
+	/* Each token has a type byte, so the count is bounded by the file size. */
+	h = map;
+	if (memcmp(h->magic, TOK_FILE_MAGIC, sizeof TOK_FILE_MAGIC) != 0 || h->version != TOK_FILE_VERSION ||
+	    h->byte_order != 0x01020304 || h->size != (uint64_t)sb.st_size || h->num_types != NUM_TOKENS ||
+	    h->num_tokens > h->size - sizeof *h || h->deltas_offset != sizeof *h + h->num_tokens) {
+		fprintf(stderr, "%s is not a token file\n", path);
+		munmap(map, sb.st_size);
+		return NULL;
+	}
+	if (h->source_hash != hash || h->source_size != size) {
+		munmap(map, sb.st_size);
+		return NULL;
+	}
+
+	/* Decoded straight into the columns, a chunk at a time. */
+	st = tok_store_new(source, filename);
+	types = (const uint8_t *)map + sizeof *h;
+	p = (const uint8_t *)map + h->deltas_offset;
+	end = (const uint8_t *)map + h->size;
+	while (st->num_tokens < (ptrdiff_t)h->num_tokens) {
+		struct tok_store_chunk *chunk;
+		size_t n = h->num_tokens - st->num_tokens;
+
+		if (n > TOK_STORE_CHUNK)
+			n = TOK_STORE_CHUNK;
+		store_grow(st);
+		chunk = st->chunks[st->num_chunks - 1];
+		memcpy(chunk->type, types + st->num_tokens, n);
+		for (size_t k = 0; k < n; k++) {
+			if ((p = get_varint(p, end, &gap)) == NULL || (p = get_varint(p, end, &length)) == NULL ||
+			    (p = get_varint(p, end, &dline)) == NULL || (p = get_varint(p, end, &dcol)) == NULL ||
+			    chunk->type[k] >= NUM_TOKENS || gap > size - last || length > size - last - gap ||
+			    length > UINT32_MAX || dline > (uint64_t)(INT_MAX - line) ||
+			    dcol > (uint64_t)(INT_MAX - (dline == 0 ? col : 0))) {
+				fprintf(stderr, "%s is damaged\n", path);
+				tok_store_free(st);
+				munmap(map, sb.st_size);
+				return NULL;
+			}
+			chunk->offset[k] = last + gap;
+			chunk->length[k] = length;
+			line += dline;
+			col = dline == 0 ? col + dcol : dcol;
+			chunk->line[k] = line;
+			chunk->col[k] = col;
+			last += gap + length;
+		}
+		st->num_tokens += n;
+	}
+	if (p != end) {
+		fprintf(stderr, "%s is damaged\n", path);
+		tok_store_free(st);
+		st = NULL;
+	}
+	munmap(map, sb.st_size);
+	return st;
 }
 
-void tok_tokenlist_clear(struct tok_tokenlist *list)
+// A cache is a directory of saved stores, each named by a key in 16 hex digits
+// and .mtc. The key is the hash the store is saved with, so a hit is checked
+// by the hash in the file's header; callers make it from a hash of the source
+// and of whatever else decides its tokens. Entries are written under a
+// temporary name and renamed, so concurrent users never see half an entry,
+// and used ones are touched. Evicting removes the least recently used entries
+// until the cache fits in its size, along with temporaries that a process
+// which died left behind. Only names of those two forms are ever removed, an
+// entry name and, for a temporary, the pid and id of whoever wrote it.
+
+#define TOK_CACHE_STALE (10 * 60) /* seconds before an unchanged temporary is abandoned */
+
+/* Returns the store cached under key for the size bytes at source, or NULL. */
+struct tok_store *tok_cache_load(const char *dir, uint64_t key, const char *source, size_t size,
+    const char *filename)
 {
-	list->num_tokens = 0;
+	struct tok_store *st;
+	char *entry;
+
+	asprintf(&entry, "%s/%016" PRIx64 ".mtc", dir, key);
+	if ((st = tok_store_load(entry, key, source, size, filename)) != NULL)
+		utimensat(AT_FDCWD, entry, NULL, 0);
+	free(entry);
+	return st;
+}
+
+/*
+ * Caches st, for a source of size bytes, under key. id tells apart the
+ * temporaries of threads in the same process. The cache is only an
+ * optimization, so failing to fill it is not an error.
+ */
+void tok_cache_save(const char *dir, uint64_t key, const struct tok_store *st, size_t size, int id)
+{
+	char *entry, *tmp;
+
+	asprintf(&entry, "%s/%016" PRIx64 ".mtc", dir, key);
+	asprintf(&tmp, "%s.%ld.%d", entry, (long)getpid(), id);
+	if (tok_store_save(st, tmp, key, size) != 0 || rename(tmp, entry) != 0)
+		remove(tmp);
+	free(tmp);
+	free(entry);
+}
+
+struct cache_entry {
+	char *name;
+	uint64_t size;
+	struct timespec used;
+};
+
+static int entry_older(const void *x, const void *y)
+{
+	const struct cache_entry *a = x, *b = y;
+
+	if (a->used.tv_sec != b->used.tv_sec)
+		return a->used.tv_sec < b->used.tv_sec ? -1 : 1;
+	if (a->used.tv_nsec != b->used.tv_nsec)
+		return a->used.tv_nsec < b->used.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* Returns the length of the entry name that name starts with, or 0. */
+static size_t entry_name(const char *name)
+{
+	for (int i = 0; i < 16; i++)
+		if (!isxdigit((unsigned char)name[i]))
+			return 0;
+	return strncmp(name + 16, ".mtc", 4) == 0 ? 20 : 0;
+}
+
+/* Returns whether s is the .pid.id that a temporary adds to an entry name. */
+static int temporary_suffix(const char *s)
+{
+	for (int k = 0; k < 2; k++) {
+		if (*s++ != '.' || !isdigit((unsigned char)*s))
+			return 0;
+		while (isdigit((unsigned char)*s))
+			s++;
+	}
+	return *s == '\0';
+}
+
+/*
+ * Removes the least recently used entries until the cache fits in max_size
+ * bytes, and temporaries that have not been written to for TOK_CACHE_STALE.
+ */
+void tok_cache_evict(const char *dir, uint64_t max_size)
+{
+	struct cache_entry *entries = NULL;
+	ptrdiff_t num_entries = 0, capacity = 0, i;
+	uint64_t total = 0;
+	time_t now = time(NULL);
+	struct dirent *d;
+	struct stat st;
+	size_t len;
+	DIR *dp;
+
+	if ((dp = opendir(dir)) == NULL)
+		return;
+	while ((d = readdir(dp)) != NULL) {
+		if ((len = entry_name(d->d_name)) == 0 ||
+		    fstatat(dirfd(dp), d->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (d->d_name[len] != '\0') {
+			if (temporary_suffix(d->d_name + len) && now - st.st_mtime > TOK_CACHE_STALE)
+				unlinkat(dirfd(dp), d->d_name, 0);
+			continue;
+		}
+		if (num_entries >= capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			entries = erealloc(entries, capacity * sizeof *entries);
+		}
+		entries[num_entries++] = (struct cache_entry){strdup(d->d_name), st.st_size, st.st_mtim};
+		total += st.st_size;
+	}
+
+	qsort(entries, num_entries, sizeof *entries, entry_older);
+	for (i = 0; i < num_entries; i++) {
+		if (total > max_size && unlinkat(dirfd(dp), entries[i].name, 0) == 0)
+			total -= entries[i].size;
+		free(entries[i].name);
+	}
+	free(entries);
+	closedir(dp);
 }
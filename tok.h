@@ -86,36 +86,64 @@ enum token_type {
 };
 struct token {
 	int   type;
-	char *string;
+	char *string;       /* lexeme as a string, or NULL until token_materialize */
+	const char *text;   /* lexeme, not NUL-terminated, in the scanner's buffer */
+	size_t offset;      /* of the lexeme in the input */
+	size_t length;
 	const char *filename;
 	int   line;
 	int   col;
 };
 extern const char *token_name(int type);
 extern char *token_stringify(struct token *);
+extern char *token_materialize(struct token *);
+extern void token_fprint(FILE *f, const struct token *t);
 struct tok_defn {
 	int type;
 	struct nfa_graph *pattern;
+	const char *keyword;       /* spelling, if this is a keyword recognised from identifiers */
+	struct glushkov *glushkov; /* bit-parallel form of pattern, if it is small enough */
+	struct nfa_compact *compact; /* index form of pattern */
 };
-struct tok_tokenlist {
-	struct token **tokens;
+#define TOK_STORE_SHIFT 12
+#define TOK_STORE_CHUNK (1 << TOK_STORE_SHIFT)
+struct tok_store_chunk {
+	uint8_t type[TOK_STORE_CHUNK];
+	uint32_t length[TOK_STORE_CHUNK];
+	int32_t line[TOK_STORE_CHUNK];
+	int32_t col[TOK_STORE_CHUNK];
+	size_t offset[TOK_STORE_CHUNK];
+};
+struct tok_store {
+	struct tok_store_chunk **chunks; /* token i is in chunks[i >> TOK_STORE_SHIFT] */
+	ptrdiff_t num_chunks;            /* allocated, which may be more than are in use */
+	ptrdiff_t chunks_capacity;
 	ptrdiff_t num_tokens;
-	ptrdiff_t capacity;
+	const char *source;              /* the input the offsets are into */
+	const char *filename;
 };
-extern struct tok_tokenlist *tok_tokenlist_new(void);
-extern void tok_tokenlist_push(struct tok_tokenlist *, struct token *);
-extern void tok_tokenlist_pushclosure(struct tok_tokenlist *, struct token *);
-extern void tok_tokenlist_pushmatching(struct tok_tokenlist *, struct token *, char c);
-extern int tok_tokenlist_contains(struct tok_tokenlist *, struct token *);
-extern void tok_tokenlist_expand(struct tok_tokenlist *);
-extern void tok_tokenlist_clear(struct tok_tokenlist *);
-#define trace_tokenlist(code, list)\
+extern struct tok_store *tok_store_new(const char *source, const char *filename);
+extern void tok_store_push(struct tok_store *, const struct token *);
+extern void tok_store_get(const struct tok_store *, ptrdiff_t i, struct token *);
+extern void tok_store_clear(struct tok_store *);
+extern void tok_store_free(struct tok_store *);
+extern uint64_t tok_hash(const void *data, size_t len);
+extern int tok_store_save(const struct tok_store *, const char *path, uint64_t hash, size_t size);
+extern struct tok_store *tok_store_load(const char *path, uint64_t hash, const char *source, size_t size,
+    const char *filename);
+extern struct tok_store *tok_cache_load(const char *dir, uint64_t key, const char *source, size_t size,
+    const char *filename);
+extern void tok_cache_save(const char *dir, uint64_t key, const struct tok_store *st, size_t size, int id);
+extern void tok_cache_evict(const char *dir, uint64_t max_size);
+#define trace_store(code, store)\
 	do {\
-		struct tok_tokenlist *_l = (list);\
-		int _i;\
-		tracefx(" - " code "ns:%lu last:", _l->num_tokens);\
-		for (_i = 0; _i < _l->num_tokens; _i++) {\
-			fprintf(stderr, "{%s} ", token_stringify(_l->tokens[_i]));\
+		struct tok_store *_s = (store);\
+		struct token _t;\
+		ptrdiff_t _i;\
+		tracefx(" - " code "ns:%lu last:", _s->num_tokens);\
+		for (_i = 0; _i < _s->num_tokens; _i++) {\
+			tok_store_get(_s, _i, &_t);\
+			fprintf(stderr, "{%s} ", token_stringify(&_t));\
 		}\
 		fprintf(stderr, "\n");\
 	} while (0)
@@ -1,10 +1,20 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "util.h"
 #include "tok.h"
 #include "nfa.h"
+#include "dfa.h"
+#include "glushkov.h"
 #include "tok_scanner.h"
 
 static const char *alpha      = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
@@ -31,10 +41,15 @@ static struct nfa_graph *hex_quad(void)
 }
 
 static char *esc(char c);
-#define DEFINE(tok, expr) tokens[tok] = (struct tok_defn){tok, expr}
-void init_tokens(struct tok_defn **_tokens)
+// Everything init_tokens builds, including the tok_defn array, is allocated in
+// the arena it returns, so the whole token set can be released by freeing it.
+#define DEFINE(tok, expr) tokens[tok] = (struct tok_defn){.type = tok, .pattern = expr}
+#define KEYWORD(tok, spelling) tokens[tok] = (struct tok_defn){.type = tok, .pattern = nfa_string(spelling), .keyword = spelling}
+struct nfa_arena *init_tokens(struct tok_defn **_tokens)
 {
-	struct tok_defn *tokens = emalloc(NUM_TOKENS * (sizeof *tokens));
+	struct nfa_arena *arena = nfa_arena_new();
+	struct nfa_arena *prev = nfa_arena_use(arena);
+	struct tok_defn *tokens = nfa_alloc(NUM_TOKENS * (sizeof *tokens));
 
 	struct nfa_graph *simple_escape_sequence = nfa_symbol("\'\"?\\abfnrtv");
 	struct nfa_graph *universal_character_name =
@@ -117,35 +132,35 @@ void init_tokens(struct tok_defn **_tokens)
 	DEFINE(TOKEN_ELLIPSIS,  nfa_string("..."));
 
 	// keywords
-	DEFINE(TOKEN_BREAK,     nfa_string("break")),
-	DEFINE(TOKEN_CASE,      nfa_string("case")),
-	DEFINE(TOKEN_CONTINUE,  nfa_string("continue")),
-	DEFINE(TOKEN_DEFAULT,   nfa_string("default")),
-	DEFINE(TOKEN_CHAR,      nfa_string("char")),
-	DEFINE(TOKEN_DO,        nfa_string("do")),
-	DEFINE(TOKEN_ELSE,      nfa_string("else")),
-	DEFINE(TOKEN_ENUM,      nfa_string("enum")),
-	DEFINE(TOKEN_EXTERN,    nfa_string("extern")),
-	DEFINE(TOKEN_FLOAT,     nfa_string("float")),
-	DEFINE(TOKEN_FOR,       nfa_string("for")),
-	DEFINE(TOKEN_GOTO,      nfa_string("goto")),
-	DEFINE(TOKEN_IF,        nfa_string("if")),
-	DEFINE(TOKEN_INT,       nfa_string("int")),
-	DEFINE(TOKEN_LONG,      nfa_string("long")),
-	DEFINE(TOKEN_OPEN,      nfa_string("open")),
-	DEFINE(TOKEN_CLOSED,    nfa_string("closed")),
-	DEFINE(TOKEN_RETURN,    nfa_string("return")),
-	DEFINE(TOKEN_SHORT,     nfa_string("short")),
-	DEFINE(TOKEN_SIGNED,    nfa_string("signed")),
-	DEFINE(TOKEN_SIZEOF,    nfa_string("sizeof")),
-	DEFINE(TOKEN_STATIC,    nfa_string("static")),
-	DEFINE(TOKEN_STRUCT,    nfa_string("struct")),
-	DEFINE(TOKEN_SWITCH,    nfa_string("switch")),
-	DEFINE(TOKEN_UNION,     nfa_string("union")),
-	DEFINE(TOKEN_UNSIGNED,  nfa_string("unsigned")),
-	DEFINE(TOKEN_VOID,      nfa_string("void")),
-	DEFINE(TOKEN_VOLATILE,  nfa_string("volatile")),
-	DEFINE(TOKEN_WHILE,     nfa_string("while")),
+	KEYWORD(TOKEN_BREAK,     "break");
+	KEYWORD(TOKEN_CASE,      "case");
+	KEYWORD(TOKEN_CONTINUE,  "continue");
+	KEYWORD(TOKEN_DEFAULT,   "default");
+	KEYWORD(TOKEN_CHAR,      "char");
+	KEYWORD(TOKEN_DO,        "do");
+	KEYWORD(TOKEN_ELSE,      "else");
+	KEYWORD(TOKEN_ENUM,      "enum");
+	KEYWORD(TOKEN_EXTERN,    "extern");
+	KEYWORD(TOKEN_FLOAT,     "float");
+	KEYWORD(TOKEN_FOR,       "for");
+	KEYWORD(TOKEN_GOTO,      "goto");
+	KEYWORD(TOKEN_IF,        "if");
+	KEYWORD(TOKEN_INT,       "int");
+	KEYWORD(TOKEN_LONG,      "long");
+	KEYWORD(TOKEN_OPEN,      "open");
+	KEYWORD(TOKEN_CLOSED,    "closed");
+	KEYWORD(TOKEN_RETURN,    "return");
+	KEYWORD(TOKEN_SHORT,     "short");
+	KEYWORD(TOKEN_SIGNED,    "signed");
+	KEYWORD(TOKEN_SIZEOF,    "sizeof");
+	KEYWORD(TOKEN_STATIC,    "static");
+	KEYWORD(TOKEN_STRUCT,    "struct");
+	KEYWORD(TOKEN_SWITCH,    "switch");
+	KEYWORD(TOKEN_UNION,     "union");
+	KEYWORD(TOKEN_UNSIGNED,  "unsigned");
+	KEYWORD(TOKEN_VOID,      "void");
+	KEYWORD(TOKEN_VOLATILE,  "volatile");
+	KEYWORD(TOKEN_WHILE,     "while");
 
 	// blank tokens
 	DEFINE(TOKEN_NEWLINE,   nfa_symbol("\n"));
@@ -165,48 +180,225 @@ void init_tokens(struct tok_defn **_tokens)
 	                        ));
 	DEFINE(TOKEN_CHARACTER, nfa_concat(nfa_symbol("\'"), nfa_concat(nfa_symbol(alnum), nfa_symbol("\'"))));
 
+	for (int i = 0; i < NUM_TOKENS; i++) {
+		nfa_graph_closures(tokens[i].pattern);
+		tokens[i].glushkov = glushkov_compile(tokens[i].pattern);
+		tokens[i].compact = nfa_freeze(&tokens[i].pattern, 1);
+	}
+
+	nfa_arena_use(prev);
 	*_tokens = tokens;
+	return arena;
 }
 #undef DEFINE
+#undef KEYWORD
+
+// The combined automaton accepts tokens[i].type, so when two tokens match the
+// same longest input, the one that comes first in tokens wins. If report is
+// not NULL, the state counts before and after minimization are written to it.
+// Keywords are left out if kw is not NULL, for a scanner that looks them up in
+// it; otherwise they are compiled in like any other token.
+struct dfa *tok_compile(struct tok_defn *tokens, int n, const struct tok_keywords *kw, FILE *report)
+{
+	struct nfa_graph **graphs = emalloc(n * sizeof *graphs);
+	int32_t *labels = emalloc(n * sizeof *labels);
+	struct dfa *dfa, *min;
+	int m = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (kw != NULL && tokens[i].keyword != NULL)
+			continue;
+		graphs[m] = tokens[i].pattern;
+		labels[m++] = tokens[i].type;
+	}
+	dfa = dfa_compile_union(graphs, labels, m);
+	min = dfa_minimize(dfa);
+	if (report != NULL)
+		dfa_report(report, "tokens", dfa, min);
+
+	dfa_free(dfa);
+	free(graphs);
+	free(labels);
+	return min;
+}
 
-off_t simulate(struct nfa_graph *graph, FILE *stream)
+// The lazy automaton only builds the states the input actually reaches, using
+// at most about cap bytes for them. It keeps its own copy of the patterns, and
+// leaves out keywords if kw is not NULL, like tok_compile.
+struct dfa_lazy *tok_compile_lazy(struct tok_defn *tokens, int n, const struct tok_keywords *kw, size_t cap)
+{
+	struct nfa_graph **graphs = emalloc(n * sizeof *graphs);
+	int32_t *labels = emalloc(n * sizeof *labels);
+	struct dfa_lazy *lazy;
+	int m = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (kw != NULL && tokens[i].keyword != NULL)
+			continue;
+		graphs[m] = tokens[i].pattern;
+		labels[m++] = tokens[i].type;
+	}
+	lazy = dfa_lazy_new(graphs, labels, m, cap);
+	free(graphs);
+	free(labels);
+	return lazy;
+}
+
+// Keywords can be left out of the automata: they are then matched as
+// identifiers and looked up in a perfect hash table over the keyword
+// spellings. The seed and size are searched for when the table is built, so a
+// dialect can add keywords without the automaton growing.
+
+static uint32_t keyword_hash(uint32_t seed, const char *text, size_t len)
+{
+	uint32_t h = seed ^ 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)text[i];
+		h *= 16777619u;
+	}
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return h;
+}
+
+/* Returns NULL, with a message, if two keywords have the same spelling. */
+struct tok_keywords *tok_keywords_new(struct tok_defn *tokens, int n)
+{
+	struct tok_keywords *kw = emalloc(sizeof *kw);
+	const char **spelling = NULL;
+	int *type = NULL;
+	uint32_t size = 1;
+	int num = 0;
+
+	kw->min_len = SIZE_MAX;
+	kw->max_len = 0;
+	for (int i = 0; i < n; i++) {
+		size_t len;
+		if (tokens[i].keyword == NULL)
+			continue;
+		for (int j = 0; j < i; j++) {
+			if (tokens[j].keyword != NULL && strcmp(tokens[j].keyword, tokens[i].keyword) == 0) {
+				fprintf(stderr, "Keyword %s is defined twice\n", tokens[i].keyword);
+				free(kw);
+				return NULL;
+			}
+		}
+		len = strlen(tokens[i].keyword);
+		if (len < kw->min_len)
+			kw->min_len = len;
+		if (len > kw->max_len)
+			kw->max_len = len;
+		num++;
+	}
+	while (size < 2 * (uint32_t)num)
+		size *= 2;
+
+	for (;; size *= 2) {
+		spelling = erealloc(spelling, size * sizeof *spelling);
+		type = erealloc(type, size * sizeof *type);
+		for (uint32_t seed = 0; seed < 4096; seed++) {
+			int i;
+
+			memset(spelling, 0, size * sizeof *spelling);
+			for (i = 0; i < n; i++) {
+				const char *k = tokens[i].keyword;
+				uint32_t j;
+				if (k == NULL)
+					continue;
+				j = keyword_hash(seed, k, strlen(k)) & (size - 1);
+				if (spelling[j] != NULL)
+					break;
+				spelling[j] = k;
+				type[j] = tokens[i].type;
+			}
+			if (i == n) {
+				kw->seed = seed;
+				kw->mask = size - 1;
+				kw->spelling = spelling;
+				kw->type = type;
+				return kw;
+			}
+		}
+	}
+}
+
+/*
+ * Hashes everything that decides how input is split into tokens, the tables of
+ * the automaton and the keywords, so that tokens saved by one token set are
+ * not taken for those of another.
+ */
+uint64_t tok_fingerprint(const struct dfa *dfa, const struct tok_keywords *kw)
+{
+	uint64_t h[4];
+
+	h[0] = tok_hash(dfa->trans, (size_t)dfa->num_states * 256 * sizeof *dfa->trans);
+	h[1] = tok_hash(dfa->accept, (size_t)dfa->num_states * sizeof *dfa->accept);
+	h[2] = dfa->start;
+	h[3] = 0;
+	for (uint32_t i = 0; kw != NULL && i <= kw->mask; i++) {
+		if (kw->spelling[i] != NULL) {
+			uint64_t e[3] = {h[3], tok_hash(kw->spelling[i], strlen(kw->spelling[i])), kw->type[i]};
+			h[3] = tok_hash(e, sizeof e);
+		}
+	}
+	return tok_hash(h, sizeof h);
+}
+
+/* Returns the keyword spelt by the len bytes at text, or TOKEN_IDENT. */
+int tok_keyword(const struct tok_keywords *kw, const char *text, size_t len)
+{
+	uint32_t j;
+	const char *k;
+
+	if (len < kw->min_len || len > kw->max_len)
+		return TOKEN_IDENT;
+	j = keyword_hash(kw->seed, text, len) & kw->mask;
+	k = kw->spelling[j];
+	if (k != NULL && k[0] == text[0] && strncmp(k, text, len) == 0 && k[len] == '\0')
+		return kw->type[j];
+	return TOKEN_IDENT;
+}
+
+off_t simulate(const struct nfa_compact *nfa, FILE *stream)
 {
 	int c = '\0';
-	ptrdiff_t i = 0;
 	int count = 0;
 	int has_matched = 0;
 	int matched_count = -1;
-	struct nfa_statelist *current = nfa_statelist_new();
-	struct nfa_statelist *next = nfa_statelist_new();
-	struct nfa_statelist *tmp = NULL;
+	struct nfa_indexset *current = nfa_indexset_new(nfa->num_states);
+	struct nfa_indexset *next = nfa_indexset_new(nfa->num_states);
+	struct nfa_indexset *tmp = NULL;
 
-	nfa_statelist_pushclosure(current, graph->initial_state);
+	nfa_compact_pushclosure(nfa, current, nfa->initial[0]);
 
 	while ((c = fgetc(stream)) != EOF) {
 		count += 1;
 
-		// tracef(" - c:'%s'", esc(c));
-		// trace_statelist("c", current);
-		for (i = 0; i < (ptrdiff_t)current->num_states; i++) {
-			nfa_statelist_pushmatching(next, current->states[i], (char)c);
-		}
-		// trace_statelist("n", next);
+		nfa_compact_step(nfa, current, next, (unsigned char)c);
 
-		if (next->num_states == 0) {
+		if (next->num == 0) {
 			break;
 		}
 
-		if (nfa_statelist_contains(next, graph->final_state)) {
-			has_matched = 1;
-			matched_count = count;
+		for (int32_t i = 0; i < next->num; i++) {
+			if (nfa->accepts[next->dense[i]] == 0) {
+				has_matched = 1;
+				matched_count = count;
+				break;
+			}
 		}
 
-		nfa_statelist_clear(current);
+		current->num = 0;
 		tmp = current;
 		current = next;
 		next = tmp;
 	}
 
+	nfa_indexset_free(current);
+	nfa_indexset_free(next);
+
 	if (has_matched) {
 		fseek(stream, matched_count - count, SEEK_CUR);
 		return matched_count;
@@ -214,6 +406,49 @@ off_t simulate(struct nfa_graph *graph, FILE *stream)
 	return -count;
 }
 
+/* Like simulate, over the n bytes at buf, with more as for dfa_simulate_buf. */
+static off_t simulate_buf(const struct nfa_compact *nfa, const unsigned char *buf, size_t n, int *more)
+{
+	size_t i;
+	off_t matched_count = -1;
+	struct nfa_indexset *current = nfa_indexset_new(nfa->num_states);
+	struct nfa_indexset *next = nfa_indexset_new(nfa->num_states);
+	struct nfa_indexset *tmp = NULL;
+
+	nfa_compact_pushclosure(nfa, current, nfa->initial[0]);
+
+	for (i = 0; i < n; i++) {
+		nfa_compact_step(nfa, current, next, buf[i]);
+
+		if (next->num == 0) {
+			current->num = 0;
+			i++;
+			break;
+		}
+
+		for (int32_t j = 0; j < next->num; j++) {
+			if (nfa->accepts[next->dense[j]] == 0) {
+				matched_count = i + 1;
+				break;
+			}
+		}
+
+		current->num = 0;
+		tmp = current;
+		current = next;
+		next = tmp;
+	}
+
+	if (more != NULL)
+		*more = current->num != 0;
+	nfa_indexset_free(current);
+	nfa_indexset_free(next);
+
+	if (matched_count > 0)
+		return matched_count;
+	return -(off_t)i;
+}
+
 static char *twochar(char c, char d)
 {
 	char *s = emalloc(3);
@@ -283,42 +518,806 @@ static char *esc(char c)
 	}
 	return onechar(c);
 }
+// Tries every pattern in turn from the same place and keeps the longest match,
+// preferring earlier patterns on ties, to agree with the combined automaton.
+// Patterns small enough for the bit-parallel engine use it; the rest are
+// simulated over their compact index form.
+static off_t match_each(struct tok_scanner *s, int *type)
+{
+	long int start = ftell(s->f);
+	off_t best = 0;
+
+	for (int i = 0; i < NUM_TOKENS; i++) {
+		// fprintf(stderr, "Trying %s.\n", token_name(s->tokens[i].type));
+		off_t n;
+		if (s->keywords != NULL && s->tokens[i].keyword != NULL)
+			continue;
+		if (s->tokens[i].glushkov != NULL)
+			n = glushkov_simulate(s->tokens[i].glushkov, s->f);
+		else
+			n = simulate(s->tokens[i].compact, s->f);
+		if (n > best) {
+			best = n;
+			*type = s->tokens[i].type;
+		}
+		fseek(s->f, start, SEEK_SET);
+	}
+
+	fseek(s->f, start + best, SEEK_SET);
+	return best;
+}
+
+// Over a buffer, backtracking is just not advancing pos past what was read:
+// each matcher is handed the rest of the input and says how much it matched.
+
+static off_t match_each_buf(struct tok_scanner *s, int *type, int *more)
+{
+	const unsigned char *p = s->buf + s->pos;
+	size_t n = s->len - s->pos;
+	off_t best = 0;
+
+	*more = 0;
+	for (int i = 0; i < NUM_TOKENS; i++) {
+		off_t m;
+		int live;
+		if (s->keywords != NULL && s->tokens[i].keyword != NULL)
+			continue;
+		if (s->tokens[i].glushkov != NULL)
+			m = glushkov_simulate_buf(s->tokens[i].glushkov, p, n, &live);
+		else
+			m = simulate_buf(s->tokens[i].compact, p, n, &live);
+		*more |= live;
+		if (m > best) {
+			best = m;
+			*type = s->tokens[i].type;
+		}
+	}
+	return best;
+}
+
+// Positions are tracked as the scanner advances: line and col are those of the
+// next byte, from 1, and every line start passed so far is recorded so that an
+// earlier offset can be turned back into a position by binary search. Columns
+// count bytes. A stream only keeps the start of the line it is on, so that its
+// memory does not grow with the input.
+
+static void position_start(struct tok_scanner *s)
+{
+	s->line = 1;
+	s->col = 1;
+	s->line_starts = emalloc(16 * sizeof *s->line_starts);
+	s->lines_capacity = 16;
+	s->line_starts[0] = 0;
+	s->num_lines = 1;
+}
+
+/* Records that a line starts at offset. */
+static void position_line(struct tok_scanner *s, size_t offset)
+{
+	if (s->window != NULL) {
+		s->line_starts[0] = offset;
+		return;
+	}
+	if (s->num_lines >= s->lines_capacity) {
+		s->lines_capacity *= 2;
+		s->line_starts = erealloc(s->line_starts, s->lines_capacity * sizeof *s->line_starts);
+	}
+	s->line_starts[s->num_lines++] = offset;
+}
+
+/*
+ * Moves the position past the n bytes of text, which start at offset. Lexemes
+ * are mostly a few bytes long, so a plain loop beats calling memchr.
+ */
+static void position_advance(struct tok_scanner *s, const char *text, size_t n, size_t offset)
+{
+	size_t after = 0; /* just past the last newline */
+
+	for (size_t i = 0; i < n; i++) {
+		if (text[i] != '\n')
+			continue;
+		position_line(s, offset + i + 1);
+		s->line++;
+		after = i + 1;
+	}
+	if (after == 0)
+		s->col += n;
+	else
+		s->col = n - after + 1;
+}
+
+/*
+ * Finds the line and column of an offset the scanner has already passed.
+ * Returns 0 if it has not got that far yet, or if it is on a line a stream
+ * has forgotten.
+ */
+int tok_scanner_position(const struct tok_scanner *s, size_t offset, int *line, int *col)
+{
+	ptrdiff_t lo = 0, hi;
+
+	if (s->line == 0 || offset < s->line_starts[0] || offset > s->line_starts[s->num_lines - 1] + s->col - 1)
+		return 0;
+
+	/* The last line start at or before offset. */
+	hi = s->num_lines - 1;
+	while (lo < hi) {
+		ptrdiff_t mid = lo + (hi - lo + 1) / 2;
+		if (s->line_starts[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	*line = s->line - (s->num_lines - 1 - lo);
+	*col = offset - s->line_starts[lo] + 1;
+	return 1;
+}
+
+static int scan_token(struct tok_scanner *s, struct token *t, int report);
+static int stream_refill(struct tok_scanner *s);
+
+/*
+ * Scans the next token from the buffer into t without allocating: its text
+ * points into the buffer and its string is left NULL. Returns 0 if the input
+ * matches no token, and a TOKEN_EOF token at the end of the buffer. Scanners
+ * reading a FILE * fall back to get_token.
+ */
+int tok_scan(struct tok_scanner *s, struct token *t)
+{
+	if (s->buf == NULL) {
+		struct token *u = get_token(s);
+		if (u == NULL)
+			return 0;
+		*t = *u;
+		free(u);
+		return 1;
+	}
+
+	s->keep = s->pos;
+	return scan_token(s, t, 1);
+}
+
+/*
+ * Scans tokens into items until max are stored or TOKEN_EOF is, leaving out
+ * whitespace and newlines if flags ask for it. Returns how many were stored,
+ * fewer than max only once the end is reached or, for a stream, once the batch
+ * spans half the window, or -1 if the input matches no token or s reads a
+ * FILE *, whose tokens have no buffer for the items to point into. Calling
+ * back and forth once per batch rather than per token keeps the loops on both
+ * sides tight. A stream keeps the text of the whole batch, up to the next
+ * call, in its window, from the first token stored; what was left out before
+ * that is not kept.
+ */
+ptrdiff_t tok_scan_batch(struct tok_scanner *s, struct tok_item *items, ptrdiff_t max, int flags)
+{
+	struct token t;
+	ptrdiff_t n = 0;
+
+	if (s->buf == NULL) {
+		fprintf(stderr, "%s: Cannot scan a batch from a FILE *\n", s->filename);
+		return -1;
+	}
+	s->keep = s->pos;
+	while (n < max) {
+		if (s->window != NULL && n > 0 && s->pos - s->keep >= s->window_cap / 2)
+			break;
+		if (!scan_token(s, &t, 1))
+			return -1;
+		if ((t.type == TOKEN_WS && (flags & TOK_SKIP_WS)) || (t.type == TOKEN_NEWLINE && (flags & TOK_SKIP_NEWLINE))) {
+			if (n == 0)
+				s->keep = s->pos;
+			continue;
+		}
+		items[n++] = (struct tok_item){.type = t.type, .line = t.line, .col = t.col, .length = t.length,
+		    .offset = t.offset};
+		if (t.type == TOKEN_EOF)
+			break;
+	}
+	return n;
+}
+
+/* Fills in t from an item scanned from a buffer or stream, its text still in s. */
+void tok_item_token(const struct tok_scanner *s, const struct tok_item *item, struct token *t)
+{
+	*t = (struct token){.type = item->type, .string = NULL, .text = tok_item_text(s, item), .offset = item->offset,
+	    .length = item->length, .filename = s->filename, .line = item->line, .col = item->col};
+}
+
+/*
+ * Does the work of tok_scan for a buffer, reporting failure only if asked to.
+ * A stream is refilled and the token scanned again whenever the automaton
+ * reaches the end of what has been read, so a match is never cut short.
+ */
+static int scan_token(struct tok_scanner *s, struct token *t, int report)
+{
+	const unsigned char *p;
+	size_t len;
+	int32_t label;
+	int type, more;
+	off_t n;
+
+	if (s->line == 0)
+		position_start(s);
+	for (;;) {
+		p = s->buf + s->pos;
+		len = s->len - s->pos;
+		if (len == 0 && s->window != NULL && !s->eof) {
+			if (stream_refill(s) != 0)
+				return 0;
+			continue;
+		}
+		if (len == 0) {
+			*t = (struct token){.line = s->line, .col = s->col, .filename = s->filename, .type = TOKEN_EOF,
+			    .string = "", .text = (const char *)p, .offset = s->base + s->pos, .length = 0};
+			return 1;
+		}
+
+		if (s->dfa != NULL) {
+			n = dfa_simulate_buf(s->dfa, p, len, &label, &more);
+			type = label;
+		} else if (s->lazy != NULL) {
+			n = dfa_lazy_simulate_buf(s->lazy, p, len, &label, &more);
+			type = label;
+		} else {
+			n = match_each_buf(s, &type, &more);
+		}
+		if (!more || s->window == NULL || s->eof)
+			break;
+		if (stream_refill(s) != 0)
+			return 0;
+	}
+
+	if (n <= 0) {
+		if (report)
+			fprintf(stderr, "%s:%d:%d: Cannot match '%c' to any token.\n", s->filename, s->line, s->col, *p);
+		return 0;
+	}
+	if (type == TOKEN_IDENT && s->keywords != NULL)
+		type = tok_keyword(s->keywords, (const char *)p, n);
+
+	*t = (struct token){.line = s->line, .col = s->col, .filename = s->filename, .type = type, .string = NULL,
+	    .text = (const char *)p, .offset = s->base + s->pos, .length = n};
+	position_advance(s, t->text, n, s->base + s->pos);
+	s->pos += n;
+	return 1;
+}
+
+/* The window's text is overwritten as a stream moves on, so these own theirs. */
+static struct token *get_token_buf(struct tok_scanner *s)
+{
+	struct token *t = emalloc(sizeof *t);
+
+	if (!tok_scan(s, t)) {
+		free(t);
+		return NULL;
+	}
+	if (s->window != NULL && t->type != TOKEN_EOF)
+		t->text = token_materialize(t);
+	return t;
+}
+
+/*
+ * Scans the len bytes at buf instead of s->f. The buffer must outlive the scan.
+ * The line index and any stream window from an earlier scan are freed.
+ */
+void tok_scanner_buffer(struct tok_scanner *s, const char *buf, size_t len)
+{
+	if (s->line != 0)
+		free(s->line_starts);
+	free(s->window);
+	s->f = NULL;
+	s->buf = (const unsigned char *)buf;
+	s->len = len;
+	s->pos = 0;
+	s->map_len = 0;
+	s->window = NULL;
+	s->base = 0;
+	position_start(s);
+}
+
+// A stream is read from a file descriptor into a window, which buf points at,
+// and which is refilled when the scan reaches its end: what is left from keep
+// on, the token in progress, is moved to the front and the rest read into.
+// The window only grows when a single token does not fit in it, so memory is
+// bounded by the longest token rather than the input, and pipes and sockets
+// can be scanned. Token text points into the window, so it is only good until
+// the next token is scanned; get_token copies it.
+
+#define TOK_WINDOW (64 * 1024)
+
+/* Returns -1, with a message, if fd cannot be read. */
+static int stream_refill(struct tok_scanner *s)
+{
+	ssize_t got;
+
+	memmove(s->window, s->window + s->keep, s->len - s->keep);
+	s->base += s->keep;
+	s->len -= s->keep;
+	s->pos -= s->keep;
+	s->keep = 0;
+	if (s->len == s->window_cap) {
+		s->window_cap *= 2;
+		s->window = erealloc(s->window, s->window_cap);
+		s->buf = s->window;
+	}
+
+	while ((got = read(s->fd, s->window + s->len, s->window_cap - s->len)) < 0 && errno == EINTR)
+		;
+	if (got < 0) {
+		fprintf(stderr, "%s: Cannot read: %s\n", s->filename, strerror(errno));
+		return -1;
+	}
+	if (got == 0)
+		s->eof = 1;
+	s->len += got;
+	return 0;
+}
+
+/* Scans what can be read from fd, which is left open, in bounded memory. */
+void tok_scanner_stream(struct tok_scanner *s, int fd)
+{
+	if (s->line != 0)
+		free(s->line_starts);
+	free(s->window);
+	s->f = NULL;
+	s->fd = fd;
+	s->window_cap = TOK_WINDOW;
+	s->window = emalloc(s->window_cap);
+	s->buf = s->window;
+	s->len = 0;
+	s->pos = 0;
+	s->map_len = 0;
+	s->base = 0;
+	s->keep = 0;
+	s->eof = 0;
+	position_start(s);
+}
+
+/* Maps the file at path and scans it. Returns -1 if it cannot be mapped. */
+int tok_scanner_map(struct tok_scanner *s, const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return -1;
+	}
+	if (fstat(fd, &st) != 0) {
+		fprintf(stderr, "Cannot stat %s\n", path);
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		tok_scanner_buffer(s, "", 0);
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Cannot map %s\n", path);
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	tok_scanner_buffer(s, map, st.st_size);
+	s->map_len = st.st_size;
+	return 0;
+}
+
+/* Releases the mapping or stream window, if any, and the line index. */
+void tok_scanner_unmap(struct tok_scanner *s)
+{
+	if (s->map_len > 0)
+		munmap((void *)s->buf, s->map_len);
+	free(s->window);
+	s->window = NULL;
+	if (s->line != 0)
+		free(s->line_starts);
+	s->buf = NULL;
+	s->len = s->pos = s->map_len = 0;
+	s->line = 0;
+}
+
+// Parallel scanning splits the rest of the buffer into chunks and scans each
+// on its own thread, starting just after a newline near where the chunk
+// begins. That is only a guess at a token boundary, and positions in a chunk
+// are relative to wherever its scan started. The chunks are then stitched
+// together in order. Scanning is deterministic from a token boundary, so once
+// the tokens already accepted end where one of the chunk's tokens starts, the
+// rest of the chunk is exactly what a serial scan would produce, and it is
+// taken with its positions shifted. Until then, for example when the guess
+// fell inside a string, the stitching scans serially itself.
+
+#define TOK_CHUNK_MIN (256 * 1024)
+
+struct tok_tokens {
+	struct token *tokens;
+	ptrdiff_t num_tokens;
+	ptrdiff_t capacity;
+};
+
+struct tok_chunk {
+	struct tok_scanner s;  /* the worker's scanner, with relative positions */
+	size_t end;            /* where the next chunk's scan starts */
+	struct tok_tokens out; /* the tokens starting before end */
+	pthread_t thread;
+	int running;           /* if thread was started and must be joined */
+};
+
+static void tokens_push(struct tok_tokens *list, struct token *t)
+{
+	if (list->num_tokens >= list->capacity) {
+		list->capacity = list->capacity ? 2 * list->capacity : 1024;
+		list->tokens = erealloc(list->tokens, list->capacity * sizeof *list->tokens);
+	}
+	list->tokens[list->num_tokens++] = *t;
+}
+
+static void *chunk_scan(void *arg)
+{
+	struct tok_chunk *c = arg;
+	struct token t;
+
+	while (c->s.pos < c->end && scan_token(&c->s, &t, 0))
+		tokens_push(&c->out, &t);
+	return NULL;
+}
+
+/* Returns the index of the chunk's token starting at offset, or -1. */
+static ptrdiff_t chunk_find(const struct tok_chunk *c, size_t offset)
+{
+	ptrdiff_t lo = 0, hi = c->out.num_tokens;
+
+	while (lo < hi) {
+		ptrdiff_t mid = lo + (hi - lo) / 2;
+		if (c->out.tokens[mid].offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < c->out.num_tokens && c->out.tokens[lo].offset == offset ? lo : -1;
+}
+
+/* Takes the chunk's tokens from j on, moving s to where the chunk's scan stopped. */
+static void chunk_adopt(struct tok_scanner *s, struct tok_chunk *c, ptrdiff_t j, struct tok_tokens *out)
+{
+	int line0 = c->out.tokens[j].line, col0 = c->out.tokens[j].col;
+	int line = s->line, col = s->col;
+
+	ptrdiff_t num = c->out.num_tokens - j;
+	struct token *t;
+
+	if (out->num_tokens + num > out->capacity) {
+		out->capacity = out->num_tokens + num + out->capacity;
+		out->tokens = erealloc(out->tokens, out->capacity * sizeof *out->tokens);
+	}
+	t = memcpy(&out->tokens[out->num_tokens], &c->out.tokens[j], num * sizeof *t);
+	out->num_tokens += num;
+	for (ptrdiff_t k = 0; k < num; k++) {
+		if (t[k].line == line0)
+			t[k].col = col + (t[k].col - col0);
+		t[k].line = line + (t[k].line - line0);
+	}
+	/* line_starts[0] is only where the worker started. */
+	for (ptrdiff_t k = 1; k < c->s.num_lines; k++)
+		if (c->s.line_starts[k] > s->pos)
+			position_line(s, c->s.line_starts[k]);
+
+	s->col = c->s.line == line0 ? col + (c->s.col - col0) : c->s.col;
+	s->line = line + (c->s.line - line0);
+	s->pos = c->s.pos;
+}
+
+/*
+ * Scans the rest of the input into an array of tokens ending with TOKEN_EOF,
+ * the same as calling tok_scan until then, using up to num_threads threads.
+ * Returns NULL if some input matches no token. Scanners over a FILE * or a
+ * stream, or using a lazy DFA, which is not safe to share, are scanned
+ * serially; the text of a stream's tokens is copied.
+ */
+struct token *tok_scan_parallel(struct tok_scanner *s, int num_threads, ptrdiff_t *num_tokens)
+{
+	struct tok_tokens out = {NULL, 0, 0};
+	struct tok_chunk *chunks;
+	struct token t;
+	size_t size;
+	int n = num_threads, i, joined = 1;
+
+	if (s->buf == NULL || s->window != NULL) {
+		do {
+			if (!tok_scan(s, &t)) {
+				free(out.tokens);
+				return NULL;
+			}
+			if (s->window != NULL && t.type != TOKEN_EOF)
+				t.text = token_materialize(&t);
+			tokens_push(&out, &t);
+		} while (t.type != TOKEN_EOF);
+		*num_tokens = out.num_tokens;
+		return out.tokens;
+	}
+
+	if (s->dfa == NULL && s->lazy != NULL)
+		n = 1;
+	size = s->len - s->pos;
+	if (n > 1 && size / n < TOK_CHUNK_MIN)
+		n = size / TOK_CHUNK_MIN > 1 ? size / TOK_CHUNK_MIN : 1;
+	if (n < 1)
+		n = 1;
+	if (s->line == 0)
+		position_start(s);
+
+	chunks = emalloc(n * sizeof *chunks);
+	chunks[0].end = s->len;
+	for (i = 1; i < n; i++) {
+		struct tok_chunk *c = &chunks[i];
+		size_t from = s->pos + size / n * i;
+		const unsigned char *nl = memchr(s->buf + from, '\n', s->len - from);
+
+		from = nl != NULL ? (size_t)(nl + 1 - s->buf) : s->len;
+		if (from < chunks[i - 1].end)
+			chunks[i - 1].end = from;
+		else
+			from = chunks[i - 1].end;
+		c->s = *s;
+		c->s.pos = from;
+		position_start(&c->s);
+		c->end = s->len;
+		c->out = (struct tok_tokens){NULL, 0, 0};
+	}
+	/* A chunk without a thread has no tokens, so the stitching scans it. */
+	for (i = 1; i < n; i++)
+		chunks[i].running = pthread_create(&chunks[i].thread, NULL, chunk_scan, &chunks[i]) == 0;
+
+	/* The first chunk starts on a token, so this thread just scans it. */
+	for (i = 0; i < n; i++) {
+		struct tok_chunk *c = &chunks[i];
+		ptrdiff_t j;
+
+		if (i > 0) {
+			if (c->running)
+				pthread_join(c->thread, NULL);
+			joined++;
+		}
+		while (s->pos < c->end) {
+			if (i > 0 && (j = chunk_find(c, s->pos)) >= 0) {
+				chunk_adopt(s, c, j, &out);
+				continue;
+			}
+			if (!scan_token(s, &t, 1))
+				goto fail;
+			tokens_push(&out, &t);
+		}
+	}
+	scan_token(s, &t, 1);
+	tokens_push(&out, &t);
+
+	for (i = 1; i < n; i++) {
+		free(chunks[i].out.tokens);
+		free(chunks[i].s.line_starts);
+	}
+	free(chunks);
+	*num_tokens = out.num_tokens;
+	return out.tokens;
+
+fail:
+	for (i = 1; i < n; i++) {
+		if (i >= joined && chunks[i].running)
+			pthread_join(chunks[i].thread, NULL);
+		free(chunks[i].out.tokens);
+		free(chunks[i].s.line_starts);
+	}
+	free(chunks);
+	free(out.tokens);
+	return NULL;
+}
+
+// Re-lexing after an edit starts from a token boundary the edit cannot have
+// affected and stops as soon as a new token starts where an old one, shifted
+// by the edit, did after it: from there the input is the same, so the rest of
+// the old tokens are still right once shifted. The restart point comes from
+// how far the DFA can look ahead. If nothing but a lone newline token gets
+// past a newline, a token that starts before the last newline preceding the
+// edit never saw the edit. Otherwise the whole buffer is scanned again.
+
+static int newline_bounded(const struct dfa *dfa)
+{
+	int32_t nl = dfa->trans[dfa->start * 256 + '\n'];
+
+	for (int32_t d = 0; d < dfa->num_states; d++)
+		if (d != dfa->start && dfa->trans[d * 256 + '\n'] != DFA_DEAD)
+			return 0;
+	for (int c = 0; nl != DFA_DEAD && c < 256; c++)
+		if (dfa->trans[nl * 256 + c] != DFA_DEAD)
+			return 0;
+	return 1;
+}
+
+/* Returns the index of the first token starting at or after offset. */
+static ptrdiff_t tokens_from(const struct token *tokens, ptrdiff_t n, size_t offset)
+{
+	ptrdiff_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		ptrdiff_t mid = lo + (hi - lo) / 2;
+		if (tokens[mid].offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Updates tokens, the whole of what s scanned, for an edit that replaced the
+ * removed bytes at offset with inserted bytes, giving the len bytes at buf,
+ * which s scans from then on. Only the tokens near the edit are scanned again;
+ * the rest are moved into the new buffer. Returns 0, leaving the tokens and s
+ * as they were, if the edited input matches no token. The old buffer is only
+ * unmapped once the new one has been scanned.
+ */
+int tok_relex(struct tok_scanner *s, const char *buf, size_t len, size_t offset, size_t removed, size_t inserted,
+    struct token **tokens, ptrdiff_t *num_tokens)
+{
+	struct token *old = *tokens;
+	ptrdiff_t n = *num_tokens, r = 0, m, k, total, num_tail;
+	ptrdiff_t delta = (ptrdiff_t)inserted - (ptrdiff_t)removed;
+	struct tok_tokens fresh = {NULL, 0, 0};
+	struct tok_scanner was;
+	int first, line0, col0, line, col;
+	size_t *tail;
+	struct token t;
+
+	if (s->line == 0)
+		position_start(s);
+	was = *s;
+	if (s->dfa != NULL && newline_bounded(s->dfa)) {
+		const char *nl = offset > 0 ? memrchr(buf, '\n', offset) : NULL;
+		r = tokens_from(old, n, nl != NULL ? (size_t)(nl - buf) : 0);
+	}
+	/* With no token to restart from, everything is scanned again. */
+	if (r == n)
+		r = 0;
+
+	s->buf = (const unsigned char *)buf;
+	s->len = len;
+	s->map_len = 0;
+	s->pos = r < n ? old[r].offset : 0;
+	s->line = r < n ? old[r].line : 1;
+	s->col = r < n ? old[r].col : 1;
+	first = s->line;
+	num_tail = s->num_lines - first;
+	tail = emalloc((num_tail ? num_tail : 1) * sizeof *tail);
+	memcpy(tail, &s->line_starts[first], num_tail * sizeof *tail);
+	s->num_lines = first;
+
+	for (;;) {
+		if (s->pos >= offset + inserted && (m = tokens_from(old, n, s->pos - delta)) < n &&
+		    old[m].offset == s->pos - delta)
+			break;
+		if (!scan_token(s, &t, 1)) {
+			/* The index only grew, so the lines it dropped fit back. */
+			memcpy(&s->line_starts[first], tail, num_tail * sizeof *tail);
+			s->buf = was.buf;
+			s->len = was.len;
+			s->map_len = was.map_len;
+			s->pos = was.pos;
+			s->line = was.line;
+			s->col = was.col;
+			s->num_lines = was.num_lines;
+			free(fresh.tokens);
+			free(tail);
+			return 0;
+		}
+		tokens_push(&fresh, &t);
+		if (t.type == TOKEN_EOF) {
+			m = n;
+			break;
+		}
+	}
+
+	if (was.map_len > 0)
+		munmap((void *)was.buf, was.map_len);
+
+	/* The old tokens from m on are where they were, relative to this one, and
+	 * so is where the old scan had got to. */
+	line0 = m < n ? old[m].line : was.line;
+	col0 = m < n ? old[m].col : was.col;
+	line = s->line;
+	col = s->col;
+	for (k = 0; k < num_tail; k++)
+		if (m < n && tail[k] > old[m].offset)
+			position_line(s, tail[k] + delta);
+	if (m < n) {
+		s->col = was.line == line0 ? col + (was.col - col0) : was.col;
+		s->line = line + (was.line - line0);
+		s->pos = was.pos + delta;
+	}
+	free(tail);
+
+	for (k = r; k < m; k++)
+		if (old[k].string != NULL && old[k].type != TOKEN_EOF)
+			free(old[k].string);
+	total = r + fresh.num_tokens + (n - m);
+	if (total > n)
+		old = erealloc(old, total * sizeof *old);
+	memmove(&old[r + fresh.num_tokens], &old[m], (n - m) * sizeof *old);
+	if (fresh.num_tokens > 0)
+		memcpy(&old[r], fresh.tokens, fresh.num_tokens * sizeof *old);
+	free(fresh.tokens);
+
+	/* Moving every token into the new buffer is linear, but only arithmetic. */
+	for (k = 0; k < r; k++)
+		old[k].text = buf + old[k].offset;
+	for (k = r + fresh.num_tokens; k < total; k++) {
+		if (old[k].line == line0)
+			old[k].col = col + (old[k].col - col0);
+		old[k].line = line + (old[k].line - line0);
+		old[k].offset += delta;
+		old[k].text = buf + old[k].offset;
+	}
+
+	*tokens = old;
+	*num_tokens = total;
+	return 1;
+}
+
 struct token *get_token(struct tok_scanner *s)
 {
 	struct token *t;
+	if (s->buf != NULL)
+		return get_token_buf(s);
+	if (s->line == 0)
+		position_start(s);
 	while (!feof(s->f) && !ferror(s->f)) {
-		int i, n;
-		long int off;
+		int type;
+		off_t n;
 		char c = fgetc(s->f);
 		if (c == EOF) {
 			break;
 		}
 		ungetc(c, s->f);
-		for (i = 0; i < NUM_TOKENS; i++) {
-			// fprintf(stderr, "Trying %s.\n", token_name(s->tokens[i].type));
-			n = simulate(s->tokens[i].pattern, s->f);
-			if (n > 0) {
-				long int m = ftell(s->f);
-				char *str = emalloc(n + 1);
-				struct token *t = emalloc(sizeof *t);
-
-				fseek(s->f, -n, SEEK_CUR);
-				fgets(str, n + 1, s->f);
-				*t = (struct token){.line = 0, .col = m, .filename = s->filename, .type = s->tokens[i].type, .string = str};
-				// fprintf(stderr, "Matched \"%s\" at [%ld:%ld) to token %s.\n", escapes(str), m - n, m, token_name(s->tokens[i].type));
-				return t;
-			}
-			fseek(s->f, n, SEEK_CUR);
+
+		if (s->dfa != NULL) {
+			int32_t label;
+			n = dfa_simulate(s->dfa, s->f, &label);
+			type = label;
+		} else if (s->lazy != NULL) {
+			int32_t label;
+			n = dfa_lazy_simulate(s->lazy, s->f, &label);
+			type = label;
+		} else {
+			n = match_each(s, &type);
+		}
+
+		if (n > 0) {
+			long int m = ftell(s->f);
+			char *str = emalloc(n + 1);
+
+			t = emalloc(sizeof *t);
+			fseek(s->f, -n, SEEK_CUR);
+			fread(str, 1, n, s->f);
+			str[n] = '\0';
+			if (type == TOKEN_IDENT && s->keywords != NULL)
+				type = tok_keyword(s->keywords, str, n);
+			*t = (struct token){.line = s->line, .col = s->col, .filename = s->filename, .type = type, .string = str,
+			    .text = str, .offset = m - n, .length = n};
+			position_advance(s, str, n, m - n);
+			// fprintf(stderr, "Matched \"%s\" at [%ld:%ld) to token %s.\n", escapes(str), m - n, m, token_name(type));
+			return t;
 		}
+		fseek(s->f, n, SEEK_CUR);
 
-		off = ftell(s->f);
 		c = fgetc(s->f);
 		if (c != EOF) {
-			fprintf(stderr, "Cannot match '%c' at %ld to any token.\n", c, off);
+			fprintf(stderr, "%s:%d:%d: Cannot match '%c' to any token.\n", s->filename, s->line, s->col, c);
 			return NULL;
 		}
 	}
 	t = emalloc(sizeof *t);
-	*t = (struct token){.line = 0, .col = -1, .filename = s->filename, .type = TOKEN_EOF, .string = ""};
+	*t = (struct token){.line = s->line, .col = s->col, .filename = s->filename, .type = TOKEN_EOF, .string = "",
+	    .text = "", .offset = ftell(s->f), .length = 0};
 	return t;
 }
@@ -1,7 +1,63 @@
+struct tok_keywords {
+	uint32_t seed;
+	uint32_t mask;                /* table size - 1 */
+	size_t min_len;               /* of the keywords, to reject most identifiers unhashed */
+	size_t max_len;
+	const char *const *spelling;  /* of the keyword in each slot, or NULL */
+	const int *type;
+};
+struct tok_item {          /* a token without its text, which stays in the scanner */
+	int type;
+	int line;
+	int col;
+	uint32_t length;
+	size_t offset;
+};
+#define TOK_SKIP_WS      1
+#define TOK_SKIP_NEWLINE 2
+#define tok_item_text(s, item) ((const char *)(s)->buf + ((item)->offset - (s)->base))
+/* Starts zeroed, but for tokens, dfa and the like: tok_scanner_buffer,
+ * tok_scanner_map and tok_scanner_stream free what an earlier scan left. */
 struct tok_scanner {
 	FILE *f;
 	struct tok_defn *tokens;
 	const char *filename;
+	const struct dfa *dfa; /* all of tokens combined, or NULL to try each in turn */
+	struct dfa_lazy *lazy; /* used instead when dfa is NULL, if not NULL */
+	const struct tok_keywords *keywords; /* if not NULL, identifiers are looked up in it */
+	const unsigned char *buf; /* input, if not NULL, instead of f */
+	size_t len;
+	size_t pos;            /* of the next token in buf */
+	size_t map_len;        /* of buf if tok_scanner_map mapped it, or 0 */
+	unsigned char *window; /* buf, if streaming from fd, or NULL */
+	size_t window_cap;
+	size_t base;           /* offset in the stream of buf[0] */
+	size_t keep;           /* refilling the window keeps buf from here on */
+	int fd;
+	int eof;               /* set once fd has nothing more */
+	int line;              /* of the next byte, from 1, or 0 before the first token */
+	int col;
+	size_t *line_starts;   /* offset of each line start passed so far */
+	ptrdiff_t num_lines;
+	ptrdiff_t lines_capacity;
 };
 struct token *get_token(struct tok_scanner *);
-void init_tokens(struct tok_defn **_tokens);
+int tok_scan(struct tok_scanner *s, struct token *t);
+ptrdiff_t tok_scan_batch(struct tok_scanner *s, struct tok_item *items, ptrdiff_t max, int flags);
+void tok_item_token(const struct tok_scanner *s, const struct tok_item *item, struct token *t);
+struct token *tok_scan_parallel(struct tok_scanner *s, int num_threads, ptrdiff_t *num_tokens);
+int tok_relex(struct tok_scanner *s, const char *buf, size_t len, size_t offset, size_t removed, size_t inserted,
+    struct token **tokens, ptrdiff_t *num_tokens);
+void tok_scanner_buffer(struct tok_scanner *s, const char *buf, size_t len);
+int tok_scanner_map(struct tok_scanner *s, const char *path);
+void tok_scanner_stream(struct tok_scanner *s, int fd);
+void tok_scanner_unmap(struct tok_scanner *s);
+int tok_scanner_position(const struct tok_scanner *s, size_t offset, int *line, int *col);
+struct nfa_arena *init_tokens(struct tok_defn **_tokens);
+struct dfa *tok_compile(struct tok_defn *tokens, int n, const struct tok_keywords *kw, FILE *report);
+struct dfa_lazy *tok_compile_lazy(struct tok_defn *tokens, int n, const struct tok_keywords *kw, size_t cap);
+struct tok_keywords *tok_keywords_new(struct tok_defn *tokens, int n);
+int tok_keyword(const struct tok_keywords *kw, const char *text, size_t len);
+uint64_t tok_fingerprint(const struct dfa *dfa, const struct tok_keywords *kw);
+extern const struct dfa tok_static_dfa; /* generated by mktables */
+extern const struct tok_keywords tok_static_keywords;
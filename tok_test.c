@@ -0,0 +1,861 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#include "tok.h"
+#include "nfa.h"
+#include "dfa.h"
+#include "tok_scanner.h"
+
+// Checks the scanner's engines, inputs, saved files and cache, parallel
+// scanning and re-lexing, against the plain serial scan they must agree with:
+//
+//     cc -pthread -o tok_test tok_test.c nfa.c dfa.c glushkov.c tok.c tok_scanner.c
+//     ./tok_test
+//
+// Exits non-zero, after saying what differed, if any check fails.
+
+static int failures;
+static char dir[] = "/tmp/tok_test.XXXXXX"; /* for the files the tests write */
+
+#define check(cond, ...)\
+	do {\
+		if (!(cond)) {\
+			fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);\
+			fprintf(stderr, __VA_ARGS__);\
+			fprintf(stderr, "\n");\
+			failures++;\
+		}\
+	} while (0)
+
+static const char *const fragments[] = {
+	"static", "int", "while", "x1", "count", "42", "7", "\"a \\\"b\\\" c\"", "'q'",
+	"->", "<<=", "...", "(", ")", "{", "}", ";", ",", " ", " ", "\t", "\n", "\n",
+};
+
+/* Returns size bytes of random tokens, the same every run for the same seed. */
+static char *make_input(size_t size, unsigned seed)
+{
+	char *buf = emalloc(size + 1);
+	size_t len = 0;
+
+	srand(seed);
+	while (len < size) {
+		const char *f = fragments[rand() % (sizeof fragments / sizeof *fragments)];
+		size_t n = strlen(f);
+		if (len + n > size)
+			break;
+		memcpy(buf + len, f, n);
+		len += n;
+	}
+	memset(buf + len, ' ', size - len);
+	buf[size] = '\0';
+	return buf;
+}
+
+static int same_token(const struct token *a, const struct token *b)
+{
+	return a->type == b->type && a->offset == b->offset && a->length == b->length &&
+	    a->line == b->line && a->col == b->col;
+}
+
+/* Scans the whole buffer serially into st, which is cleared first. */
+static int scan_serial(struct tok_scanner *s, const char *buf, size_t len, struct tok_store *st)
+{
+	struct token t;
+
+	tok_scanner_buffer(s, buf, len);
+	tok_store_clear(st);
+	do {
+		if (!tok_scan(s, &t))
+			return 0;
+		tok_store_push(st, &t);
+	} while (t.type != TOKEN_EOF);
+	return 1;
+}
+
+/* Checks that the tokens in st are those in want. */
+static void check_store(const struct tok_store *st, const struct tok_store *want, const char *what)
+{
+	struct token a, b;
+	ptrdiff_t i;
+
+	check(st->num_tokens == want->num_tokens, "%s: %td tokens, not %td", what, st->num_tokens, want->num_tokens);
+	for (i = 0; i < st->num_tokens && i < want->num_tokens; i++) {
+		tok_store_get(st, i, &a);
+		tok_store_get(want, i, &b);
+		if (!same_token(&a, &b))
+			break;
+	}
+	check(i == st->num_tokens, "%s: token %td is %s at %d:%d, not %s at %d:%d", what, i, token_name(a.type),
+	    a.line, a.col, token_name(b.type), b.line, b.col);
+}
+
+/* Checks that s scans buf to exactly the tokens in want. */
+static void check_scan(struct tok_scanner *s, const char *buf, size_t len, const struct tok_store *want,
+    const char *what)
+{
+	struct tok_store *st = tok_store_new(buf, what);
+
+	check(scan_serial(s, buf, len, st), "%s: scan failed", what);
+	check_store(st, want, what);
+	tok_scanner_unmap(s);
+	tok_store_free(st);
+}
+
+// Every engine must give the tokens trying each pattern in turn does. The
+// input has every kind of token at least once, then random ones.
+
+static const char sample[] =
+	"( ) { } [ ] < > * + - ~ / \\ % ^ | & ! ; : , . = ? -> ++ -- << >> <= >= == != && || ...\n"
+	"*= /= %= += -= <<= >>= &= ^= |= <<<= a->b x+++y i--1 ....\n"
+	"break case continue default char do else enum extern float for goto if int long open closed\n"
+	"return short signed sizeof static struct switch union unsigned void volatile while\n"
+	"iff whiles _x9 Do 7 10 \"\" \"a\\n\\x1f\\101\\u00e9\\U0001F600\\\"\" 'Z' '0'\t\n";
+
+/* Returns len bytes, the sample followed by random tokens. */
+static char *engine_input(size_t len)
+{
+	char *buf = emalloc(len + 1);
+	char *rest = make_input(len - (sizeof sample - 1), 3);
+
+	memcpy(buf, sample, sizeof sample - 1);
+	memcpy(buf + sizeof sample - 1, rest, len - (sizeof sample - 1) + 1);
+	free(rest);
+	return buf;
+}
+
+/*
+ * The subset construction, over every pattern with keywords compiled in, and
+ * minimizing what it gives, which must leave nothing more to merge.
+ */
+static void test_compile(struct tok_scanner *s)
+{
+	size_t len = 64 * 1024;
+	char *buf = engine_input(len);
+	struct tok_scanner each = {.tokens = s->tokens, .filename = "each"};
+	struct tok_scanner subset = {.tokens = s->tokens, .filename = "subset"};
+	struct tok_scanner min = {.tokens = s->tokens, .filename = "minimized"};
+	struct tok_store *want = tok_store_new(buf, "each");
+	struct nfa_graph *graphs[NUM_TOKENS];
+	int32_t labels[NUM_TOKENS];
+	struct dfa *again;
+
+	for (int i = 0; i < NUM_TOKENS; i++) {
+		graphs[i] = s->tokens[i].pattern;
+		labels[i] = s->tokens[i].type;
+	}
+	subset.dfa = dfa_compile_union(graphs, labels, NUM_TOKENS);
+	min.dfa = dfa_minimize((struct dfa *)subset.dfa);
+	again = dfa_minimize((struct dfa *)min.dfa);
+
+	check(scan_serial(&each, buf, len, want), "each: scan failed");
+	check_scan(&subset, buf, len, want, "subset");
+	check_scan(&min, buf, len, want, "minimized");
+	check(min.dfa->num_states < subset.dfa->num_states, "minimizing %d states left %d", subset.dfa->num_states,
+	    min.dfa->num_states);
+	check(again->num_states == min.dfa->num_states, "minimizing %d states again left %d", min.dfa->num_states,
+	    again->num_states);
+
+	dfa_free(again);
+	dfa_free((struct dfa *)min.dfa);
+	dfa_free((struct dfa *)subset.dfa);
+	tok_scanner_unmap(&each);
+	tok_store_free(want);
+	free(buf);
+}
+
+/* The bit-parallel engine, against simulating the same patterns' NFAs. */
+static void test_glushkov(struct tok_scanner *s)
+{
+	size_t len = 64 * 1024;
+	char *buf = engine_input(len);
+	struct tok_defn plain[NUM_TOKENS];
+	struct tok_scanner glushkov = {.tokens = s->tokens, .filename = "glushkov"};
+	struct tok_scanner nfa = {.tokens = plain, .filename = "nfa"};
+	struct tok_store *want = tok_store_new(buf, "nfa");
+	int n = 0;
+
+	memcpy(plain, s->tokens, sizeof plain);
+	for (int i = 0; i < NUM_TOKENS; i++) {
+		if (plain[i].glushkov != NULL)
+			n++;
+		plain[i].glushkov = NULL;
+	}
+	check(n > NUM_TOKENS / 2, "only %d patterns have a bit-parallel form", n);
+
+	check(scan_serial(&nfa, buf, len, want), "nfa: scan failed");
+	check_scan(&glushkov, buf, len, want, "glushkov");
+
+	tok_scanner_unmap(&nfa);
+	tok_store_free(want);
+	free(buf);
+}
+
+// Keywords looked up by perfect hash after matching an identifier must give
+// the tokens compiling them into the automaton does, and two keywords spelt
+// the same must be refused.
+
+/* Returns the keyword spelt by the len bytes at text, or TOKEN_IDENT, the slow way. */
+static int find_keyword(const struct tok_defn *tokens, const char *text, size_t len)
+{
+	for (int i = 0; i < NUM_TOKENS; i++)
+		if (tokens[i].keyword != NULL && strlen(tokens[i].keyword) == len &&
+		    memcmp(tokens[i].keyword, text, len) == 0)
+			return tokens[i].type;
+	return TOKEN_IDENT;
+}
+
+static void test_keywords(struct tok_scanner *s)
+{
+	size_t len = 64 * 1024;
+	char *buf = engine_input(len);
+	struct tok_scanner compiled = {.tokens = s->tokens, .filename = "compiled"};
+	struct tok_store *want = tok_store_new(buf, "compiled");
+	struct tok_defn twice[NUM_TOKENS];
+	static const char *const idents[] = {"x1", "count", "Do", "WHILE", "_", "whilee", "sizeof_t", "i"};
+	char word[64];
+
+	for (int i = 0; i < NUM_TOKENS; i++) {
+		const char *k = s->tokens[i].keyword;
+		size_t n;
+		if (k == NULL)
+			continue;
+		n = strlen(k);
+		check(tok_keyword(s->keywords, k, n) == s->tokens[i].type, "%s is not a keyword", k);
+		for (size_t m = 1; m < n; m++)
+			check(tok_keyword(s->keywords, k, m) == find_keyword(s->tokens, k, m), "%.*s is wrong", (int)m, k);
+		snprintf(word, sizeof word, "%s_", k);
+		check(tok_keyword(s->keywords, word, n + 1) == TOKEN_IDENT, "%s is a keyword", word);
+	}
+	for (size_t i = 0; i < sizeof idents / sizeof *idents; i++)
+		check(tok_keyword(s->keywords, idents[i], strlen(idents[i])) == TOKEN_IDENT, "%s is a keyword", idents[i]);
+
+	compiled.dfa = tok_compile(s->tokens, NUM_TOKENS, NULL, NULL);
+	check(scan_serial(&compiled, buf, len, want), "compiled: scan failed");
+	check_scan(s, buf, len, want, "hashed");
+
+	memcpy(twice, s->tokens, sizeof twice);
+	twice[TOKEN_IF].keyword = "while";
+	check(tok_keywords_new(twice, NUM_TOKENS) == NULL, "while was taken as a keyword twice");
+
+	dfa_free((struct dfa *)compiled.dfa);
+	tok_scanner_unmap(&compiled);
+	tok_store_free(want);
+	free(buf);
+}
+
+/*
+ * Returns how many times the lazy DFA's cache has been flushed, going by its
+ * report, or -1.
+ */
+static long lazy_flushes(struct dfa_lazy *lazy)
+{
+	char *report = NULL;
+	size_t size;
+	FILE *f = open_memstream(&report, &size);
+	const char *p;
+	long n = -1;
+
+	dfa_lazy_report(f, "lazy", lazy);
+	fclose(f);
+	if ((p = strrchr(report, ',')) == NULL || sscanf(p, ", %ld flushes", &n) != 1)
+		n = -1;
+	free(report);
+	return n;
+}
+
+/* The lazy DFA, with caps small enough to flush it every few tokens or less. */
+static void test_lazy(struct tok_scanner *s)
+{
+	size_t len = 64 * 1024;
+	char *buf = engine_input(len);
+	struct tok_store *want = tok_store_new(buf, "dfa");
+	static const size_t caps[] = {1, 8 * 1024, 1024 * 1024};
+
+	check(scan_serial(s, buf, len, want), "dfa: scan failed");
+	tok_scanner_unmap(s);
+	for (size_t k = 0; k < sizeof caps / sizeof *caps; k++) {
+		struct tok_scanner lazy = {.tokens = s->tokens, .keywords = s->keywords, .filename = "lazy"};
+		long flushes;
+
+		lazy.lazy = tok_compile_lazy(s->tokens, NUM_TOKENS, s->keywords, caps[k]);
+		check_scan(&lazy, buf, len, want, "lazy");
+		flushes = lazy_flushes(lazy.lazy);
+		if (caps[k] < 1024 * 1024)
+			check(flushes > 0, "a cap of %zu bytes was never flushed", caps[k]);
+		else
+			check(flushes == 0, "a cap of %zu bytes was flushed %ld times", caps[k], flushes);
+		dfa_lazy_free(lazy.lazy);
+	}
+	tok_store_free(want);
+	free(buf);
+}
+
+// A saved DFA must load back to one that scans the same, and a file that has
+// been cut short or has a bad header, transition or label must not load.
+
+/* Writes len bytes of data to path, returning 0 or -1. */
+static int write_file(const char *path, const void *data, size_t len)
+{
+	FILE *f = fopen(path, "wb");
+	int err = 0;
+
+	if (f == NULL)
+		return -1;
+	if (fwrite(data, 1, len, f) != len)
+		err = -1;
+	if (fclose(f) != 0)
+		err = -1;
+	return err;
+}
+
+/* Returns the contents of path, with their length in len, or NULL. */
+static char *read_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "rb");
+	char *data;
+	long size;
+
+	if (f == NULL)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	data = emalloc(size > 0 ? size : 1);
+	if (size < 0 || fread(data, 1, size, f) != (size_t)size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	*len = size;
+	return data;
+}
+
+static void test_dfa_file(struct tok_scanner *s)
+{
+	size_t len = 64 * 1024, size;
+	char *buf = engine_input(len);
+	struct tok_store *want = tok_store_new(buf, "dfa");
+	struct tok_scanner loaded = {.tokens = s->tokens, .keywords = s->keywords, .filename = "loaded"};
+	char *path, *bad, *data;
+	uint64_t trans_offset;
+
+	asprintf(&path, "%s/tokens.dfa", dir);
+	asprintf(&bad, "%s/bad.dfa", dir);
+	check(scan_serial(s, buf, len, want), "dfa: scan failed");
+	tok_scanner_unmap(s);
+
+	check(dfa_save(s->dfa, path) == 0, "cannot save %s", path);
+	loaded.dfa = dfa_load(path, NUM_TOKENS);
+	check(loaded.dfa != NULL, "cannot load %s", path);
+	if (loaded.dfa != NULL) {
+		check(loaded.dfa->num_states == s->dfa->num_states && loaded.dfa->start == s->dfa->start,
+		    "loaded %d states from %d", loaded.dfa->num_states, s->dfa->num_states);
+		check_scan(&loaded, buf, len, want, "loaded");
+	}
+	check(dfa_load(path, TOKEN_IDENT) == NULL, "loaded labels that are not below TOKEN_IDENT");
+
+	/* The header is a magic string, the version, the byte order, the number
+	 * of states and the start, then the offset of the transitions. */
+	data = read_file(path, &size);
+	check(data != NULL, "cannot read %s", path);
+	if (data != NULL) {
+		memcpy(&trans_offset, data + 24, sizeof trans_offset);
+		check(write_file(bad, data, size - 64) == 0 && dfa_load(bad, NUM_TOKENS) == NULL,
+		    "loaded a truncated file");
+		check(write_file(bad, data, 16) == 0 && dfa_load(bad, NUM_TOKENS) == NULL, "loaded half a header");
+		data[0] ^= 1;
+		check(write_file(bad, data, size) == 0 && dfa_load(bad, NUM_TOKENS) == NULL, "loaded a bad magic string");
+		data[0] ^= 1;
+		data[trans_offset + 4 * 'x'] = 0x7f;
+		check(write_file(bad, data, size) == 0 && dfa_load(bad, NUM_TOKENS) == NULL, "loaded a bad transition");
+		unlink(bad);
+		free(data);
+	}
+
+	unlink(path);
+	free(bad);
+	free(path);
+	tok_store_free(want);
+	free(buf);
+}
+
+// Scanning a FILE *, a stream and a buffer must give the same tokens. The
+// stream is read both from a file and from a pipe fed a few bytes at a time,
+// so its window is refilled in the middle of tokens, and one string is longer
+// than the window, so it has to grow.
+
+/* Scans the rest of s's input into st, which is cleared first. */
+static int scan_rest(struct tok_scanner *s, struct tok_store *st)
+{
+	struct token t;
+
+	tok_store_clear(st);
+	do {
+		if (!tok_scan(s, &t))
+			return 0;
+		tok_store_push(st, &t);
+		if (s->buf == NULL && t.type != TOKEN_EOF)
+			free(t.string);
+	} while (t.type != TOKEN_EOF);
+	return 1;
+}
+
+struct feeder {
+	int fd;
+	const char *buf;
+	size_t len;
+};
+
+/* Writes the buffer to the pipe in pieces of an odd size, then closes it. */
+static void *feed(void *arg)
+{
+	struct feeder *f = arg;
+	size_t done = 0;
+
+	while (done < f->len) {
+		size_t n = f->len - done < 4093 ? f->len - done : 4093;
+		ssize_t w = write(f->fd, f->buf + done, n);
+		if (w < 0)
+			break;
+		done += w;
+	}
+	close(f->fd);
+	return NULL;
+}
+
+static void test_inputs(struct tok_scanner *s)
+{
+	size_t head = 64 * 1024, body = 150 * 1024, tail = 256 * 1024;
+	size_t len = head + body + tail;
+	char *buf = emalloc(len + 1), *part;
+	struct tok_store *want = tok_store_new(buf, "buffer");
+	struct tok_store *st = tok_store_new(buf, "other");
+	struct tok_scanner other = {.tokens = s->tokens, .dfa = s->dfa, .keywords = s->keywords, .filename = "other"};
+	struct feeder feeder;
+	pthread_t thread;
+	char *path;
+	int fds[2], fd;
+
+	part = engine_input(head);
+	memcpy(buf, part, head);
+	free(part);
+	buf[head] = '"';
+	memset(buf + head + 1, 'a', body - 3);
+	memcpy(buf + head + body - 2, "\"\n", 2);
+	part = make_input(tail, 4);
+	memcpy(buf + head + body, part, tail + 1);
+	free(part);
+
+	asprintf(&path, "%s/input.c", dir);
+	check(write_file(path, buf, len) == 0, "cannot write %s", path);
+	check(scan_serial(s, buf, len, want), "buffer: scan failed");
+	tok_scanner_unmap(s);
+
+	other.f = fopen(path, "rb");
+	check(other.f != NULL, "cannot open %s", path);
+	if (other.f != NULL) {
+		check(scan_rest(&other, st), "FILE *: scan failed");
+		check_store(st, want, "FILE *");
+		fclose(other.f);
+		other.f = NULL;
+	}
+
+	fd = open(path, O_RDONLY);
+	check(fd >= 0, "cannot open %s", path);
+	if (fd >= 0) {
+		tok_scanner_stream(&other, fd);
+		check(scan_rest(&other, st), "file stream: scan failed");
+		check_store(st, want, "file stream");
+		close(fd);
+	}
+
+	check(pipe(fds) == 0, "cannot make a pipe");
+	feeder = (struct feeder){.fd = fds[1], .buf = buf, .len = len};
+	if (pthread_create(&thread, NULL, feed, &feeder) == 0) {
+		tok_scanner_stream(&other, fds[0]);
+		check(scan_rest(&other, st), "pipe stream: scan failed");
+		check_store(st, want, "pipe stream");
+		pthread_join(thread, NULL);
+	}
+	close(fds[0]);
+
+	tok_scanner_unmap(&other);
+	unlink(path);
+	free(path);
+	tok_store_free(st);
+	tok_store_free(want);
+	free(buf);
+}
+
+// Saved tokens must load back as they were, over the same source, and a file
+// for other input, or that has been cut short or damaged, must not load. The
+// header is 64 bytes, the file's size being its last field, and the types
+// follow it a byte each.
+
+static void test_store_file(struct tok_scanner *s)
+{
+	size_t len = 256 * 1024, size;
+	char *buf = make_input(len, 5);
+	struct tok_store *want = tok_store_new(buf, "saved");
+	struct tok_store *st;
+	uint64_t hash = tok_hash(buf, len), file_size;
+	char *path, *bad, *data, type;
+
+	asprintf(&path, "%s/input.tok", dir);
+	asprintf(&bad, "%s/bad.tok", dir);
+	check(scan_serial(s, buf, len, want), "saved: scan failed");
+	tok_scanner_unmap(s);
+	check(want->num_tokens > 2 * TOK_STORE_CHUNK, "only %td tokens", want->num_tokens);
+
+	check(tok_store_save(want, path, hash, len) == 0, "cannot save %s", path);
+	st = tok_store_load(path, hash, buf, len, "loaded");
+	check(st != NULL, "cannot load %s", path);
+	if (st != NULL) {
+		check(st->source == buf, "loaded tokens are not over the source");
+		check_store(st, want, "loaded");
+		tok_store_free(st);
+	}
+	check(tok_store_load(path, hash + 1, buf, len, "loaded") == NULL, "loaded tokens for another hash");
+	check(tok_store_load(path, hash, buf, len - 1, "loaded") == NULL, "loaded tokens for another size");
+	check(tok_store_load(bad, hash, buf, len, "loaded") == NULL, "loaded a file that is not there");
+
+	data = read_file(path, &size);
+	check(data != NULL, "cannot read %s", path);
+	if (data != NULL) {
+		check(write_file(bad, data, size - 1) == 0 && tok_store_load(bad, hash, buf, len, "bad") == NULL,
+		    "loaded a truncated file");
+		data[0] ^= 1;
+		check(write_file(bad, data, size) == 0 && tok_store_load(bad, hash, buf, len, "bad") == NULL,
+		    "loaded a bad magic string");
+		data[0] ^= 1;
+		type = data[64];
+		data[64] = NUM_TOKENS;
+		check(write_file(bad, data, size) == 0 && tok_store_load(bad, hash, buf, len, "bad") == NULL,
+		    "loaded a bad type");
+		data[64] = type;
+		data = erealloc(data, size + 1);
+		data[size] = 0;
+		file_size = size + 1;
+		memcpy(data + 56, &file_size, sizeof file_size);
+		check(write_file(bad, data, size + 1) == 0 && tok_store_load(bad, hash, buf, len, "bad") == NULL,
+		    "loaded a file with a byte left over");
+		unlink(bad);
+		free(data);
+	}
+
+	unlink(path);
+	free(bad);
+	free(path);
+	tok_store_free(want);
+	free(buf);
+}
+
+// A cache must give back what was saved in it and miss what was not. Evicting
+// must remove the least recently used entries first, a hit counting as a use,
+// and stale temporaries, and leave every other file alone.
+
+/* Sets the modification time of name in dir to age seconds ago. */
+static void age_file(const char *dir, const char *name, time_t age)
+{
+	struct timespec times[2] = {{.tv_sec = time(NULL) - age}, {.tv_sec = time(NULL) - age}};
+	char *path;
+
+	asprintf(&path, "%s/%s", dir, name);
+	check(utimensat(AT_FDCWD, path, times, 0) == 0, "cannot age %s", path);
+	free(path);
+}
+
+/* Returns whether dir has a file called name. */
+static int has_file(const char *dir, const char *name)
+{
+	struct stat st;
+	char *path;
+	int found;
+
+	asprintf(&path, "%s/%s", dir, name);
+	found = stat(path, &st) == 0;
+	free(path);
+	return found;
+}
+
+static void test_cache(struct tok_scanner *s)
+{
+	size_t len = 64 * 1024;
+	char *buf = make_input(len, 6);
+	struct tok_store *want = tok_store_new(buf, "cached");
+	struct tok_store *st;
+	static const char *const entries[] = {
+		"0000000000000001.mtc", "0000000000000002.mtc", "0000000000000003.mtc", "0000000000000004.mtc",
+	};
+	static const char *const others[] = {
+		"notes.txt", "0000000000000005.mtc.bak", "0000000000000006.mtc.1.0", "000000000000000g.mtc",
+	};
+	char *cache, *path;
+	struct stat sb;
+
+	asprintf(&cache, "%s/cache", dir);
+	check(mkdir(cache, 0777) == 0, "cannot create %s", cache);
+	check(scan_serial(s, buf, len, want), "cached: scan failed");
+	tok_scanner_unmap(s);
+
+	check(tok_cache_load(cache, 1, buf, len, "cached") == NULL, "an empty cache had a hit");
+	tok_cache_save(cache, 1, want, len, 0);
+	st = tok_cache_load(cache, 1, buf, len, "cached");
+	check(st != NULL, "a saved entry missed");
+	if (st != NULL) {
+		check_store(st, want, "cached");
+		tok_store_free(st);
+	}
+	check(tok_cache_load(cache, 2, buf, len, "cached") == NULL, "another key had a hit");
+
+	/* Entries from oldest to newest, then a hit on the oldest. */
+	for (int k = 0; k < 4; k++) {
+		tok_cache_save(cache, k + 1, want, len, 0);
+		age_file(cache, entries[k], 400 - 100 * k);
+	}
+	for (size_t k = 0; k < sizeof others / sizeof *others; k++) {
+		asprintf(&path, "%s/%s", cache, others[k]);
+		check(write_file(path, "x", 1) == 0, "cannot write %s", path);
+		age_file(cache, others[k], 3600);
+		free(path);
+	}
+	asprintf(&path, "%s/0000000000000007.mtc.1.0", cache);
+	check(write_file(path, "x", 1) == 0, "cannot write %s", path);
+	free(path);
+	st = tok_cache_load(cache, 1, buf, len, "cached");
+	check(st != NULL, "a saved entry missed");
+	if (st != NULL)
+		tok_store_free(st);
+
+	asprintf(&path, "%s/%s", cache, entries[0]);
+	check(stat(path, &sb) == 0, "cannot stat %s", path);
+	free(path);
+	tok_cache_evict(cache, 2 * sb.st_size);
+	check(has_file(cache, entries[0]) && !has_file(cache, entries[1]) && !has_file(cache, entries[2]) &&
+	    has_file(cache, entries[3]), "the wrong entries were evicted");
+	check(!has_file(cache, others[2]), "a stale temporary was kept");
+	check(has_file(cache, "0000000000000007.mtc.1.0"), "a fresh temporary was evicted");
+	check(has_file(cache, others[0]) && has_file(cache, others[1]) && has_file(cache, others[3]),
+	    "a file the cache did not write was evicted");
+
+	tok_cache_evict(cache, 0);
+	for (int k = 0; k < 4; k++)
+		check(!has_file(cache, entries[k]), "%s was kept in an empty cache", entries[k]);
+
+	for (size_t k = 0; k < sizeof others / sizeof *others; k++) {
+		asprintf(&path, "%s/%s", cache, others[k]);
+		unlink(path);
+		free(path);
+	}
+	asprintf(&path, "%s/0000000000000007.mtc.1.0", cache);
+	unlink(path);
+	free(path);
+	rmdir(cache);
+	free(cache);
+	tok_store_free(want);
+	free(buf);
+}
+
+// Parallel scanning must give exactly the serial tokens, whichever chunk
+// boundaries the thread count leads to, and must leave the scanner able to
+// turn any offset back into the position of the token there.
+
+static void test_parallel(struct tok_scanner *s)
+{
+	size_t len = 3 * 1024 * 1024;
+	char *buf = make_input(len, 1);
+	struct tok_store *st = tok_store_new(buf, "parallel");
+	static const int threads[] = {1, 2, 3, 8};
+
+	check(scan_serial(s, buf, len, st), "serial scan failed");
+	for (size_t k = 0; k < sizeof threads / sizeof *threads; k++) {
+		ptrdiff_t n, i;
+		struct token *tokens;
+		struct token t;
+
+		tok_scanner_buffer(s, buf, len);
+		tokens = tok_scan_parallel(s, threads[k], &n);
+		check(tokens != NULL, "%d threads: scan failed", threads[k]);
+		if (tokens == NULL)
+			continue;
+		check(n == st->num_tokens, "%d threads: %td tokens, not %td", threads[k], n, st->num_tokens);
+		for (i = 0; i < n && i < st->num_tokens; i++) {
+			tok_store_get(st, i, &t);
+			if (!same_token(&tokens[i], &t))
+				break;
+		}
+		check(i == n, "%d threads: token %td is %s at %d:%d, not %s at %d:%d", threads[k], i,
+		    token_name(tokens[i].type), tokens[i].line, tokens[i].col, token_name(t.type), t.line, t.col);
+		for (i = 0; i < n; i++) {
+			int line, col;
+			if (!tok_scanner_position(s, tokens[i].offset, &line, &col) ||
+			    line != tokens[i].line || col != tokens[i].col)
+				break;
+		}
+		check(i == n, "%d threads: wrong position for token %td", threads[k], i);
+		free(tokens);
+	}
+	tok_scanner_unmap(s);
+	tok_store_free(st);
+	free(buf);
+}
+
+// Re-lexing an edit must give what scanning the edited input from scratch
+// does, and leave the scanner where that scan would, including when the old
+// tokens stop short of the end. An edit that cannot be scanned must leave the
+// tokens and the scanner as they were.
+
+/* Replaces the removed bytes at offset with text, in a new buffer. */
+static char *edit(const char *buf, size_t len, size_t offset, size_t removed, const char *text, size_t *new_len)
+{
+	size_t inserted = strlen(text);
+	char *out = emalloc(len - removed + inserted + 1);
+
+	memcpy(out, buf, offset);
+	memcpy(out + offset, text, inserted);
+	memcpy(out + offset + inserted, buf + offset + removed, len - offset - removed);
+	*new_len = len - removed + inserted;
+	out[*new_len] = '\0';
+	return out;
+}
+
+/* Checks tokens against a fresh serial scan of buf, or that there is none. */
+static void check_rescan(struct tok_scanner *s, const struct token *tokens, ptrdiff_t n, const char *buf, size_t len,
+    const char *what)
+{
+	struct tok_scanner ref = {.tokens = s->tokens, .dfa = s->dfa, .keywords = s->keywords, .filename = what};
+	struct tok_store *st = tok_store_new(buf, what);
+	struct token t;
+	ptrdiff_t i;
+
+	check(scan_serial(&ref, buf, len, st), "%s: edited input does not scan", what);
+	check(n == st->num_tokens, "%s: %td tokens, not %td", what, n, st->num_tokens);
+	for (i = 0; i < n && i < st->num_tokens; i++) {
+		tok_store_get(st, i, &t);
+		if (!same_token(&tokens[i], &t) || tokens[i].text != buf + tokens[i].offset)
+			break;
+	}
+	check(i == n, "%s: token %td differs", what, i);
+	check(s->pos == ref.pos && s->line == ref.line && s->col == ref.col && s->num_lines == ref.num_lines &&
+	    memcmp(s->line_starts, ref.line_starts, s->num_lines * sizeof *s->line_starts) == 0,
+	    "%s: scanner is at %d:%d, not %d:%d", what, s->line, s->col, ref.line, ref.col);
+	tok_scanner_unmap(&ref);
+	tok_store_free(st);
+}
+
+static void test_relex(struct tok_scanner *s)
+{
+	size_t len = 64 * 1024, new_len;
+	char *buf = make_input(len, 2), *next;
+	struct token *tokens, *copy;
+	ptrdiff_t n, num_copy, half;
+	struct token t;
+
+	/* Random edits within a token, or of a whole string or character, so that
+	 * the edited input still scans, each checked against a full scan. */
+	tok_scanner_buffer(s, buf, len);
+	tokens = tok_scan_parallel(s, 1, &n);
+	for (int k = 0; k < 500; k++) {
+		const struct token *at = &tokens[rand() % n];
+		const char *text = fragments[rand() % (sizeof fragments / sizeof *fragments)];
+		size_t offset = at->offset, removed = at->length;
+
+		if (at->type != TOKEN_STRING && at->type != TOKEN_CHARACTER) {
+			offset += rand() % (at->length + 1);
+			removed = rand() % (at->offset + at->length - offset + 1);
+		}
+		next = edit(buf, len, offset, removed, text, &new_len);
+		check(tok_relex(s, next, new_len, offset, removed, strlen(text), &tokens, &n), "edit %d failed", k);
+		check_rescan(s, tokens, n, next, new_len, "edit");
+		free(buf);
+		buf = next;
+		len = new_len;
+	}
+
+	/* An edit that matches no token, which says so, changes nothing. */
+	num_copy = n;
+	copy = emalloc(n * sizeof *copy);
+	memcpy(copy, tokens, n * sizeof *copy);
+	next = edit(buf, len, 0, 0, "\"", &new_len);
+	check(!tok_relex(s, next, new_len, 0, 0, 1, &tokens, &n), "an unterminated string relexed");
+	check(n == num_copy && memcmp(tokens, copy, n * sizeof *copy) == 0, "a failed relex changed the tokens");
+	check_rescan(s, tokens, n, buf, len, "failed edit");
+	free(next);
+	free(copy);
+	free(tokens);
+
+	/* Tokens scanned only part of the way, then the rest. */
+	tok_scanner_buffer(s, buf, len);
+	tokens = emalloc(len * sizeof *tokens);
+	for (n = 0, half = len / 4; n < half && tok_scan(s, &tokens[n]); n++)
+		;
+	next = edit(buf, len, tokens[n / 2].offset, 0, "while ", &new_len);
+	check(tok_relex(s, next, new_len, tokens[n / 2].offset, 0, 6, &tokens, &n), "partial relex failed");
+	tokens = erealloc(tokens, (new_len + 1) * sizeof *tokens);
+	do
+		check(tok_scan(s, &t), "scan after a partial relex failed");
+	while ((tokens[n++] = t).type != TOKEN_EOF);
+	check_rescan(s, tokens, n, next, new_len, "partial");
+	free(tokens);
+	free(buf);
+	buf = next;
+	len = new_len;
+
+	/* No tokens at all. */
+	tok_scanner_unmap(s);
+	tokens = NULL;
+	n = 0;
+	check(tok_relex(s, buf, len, 0, 0, 0, &tokens, &n), "relex of nothing failed");
+	check_rescan(s, tokens, n, buf, len, "empty");
+	free(tokens);
+	tok_scanner_unmap(s);
+	free(buf);
+}
+
+int main(void)
+{
+	struct tok_scanner s = {.filename = "tok_test"};
+	struct nfa_arena *arena = init_tokens(&s.tokens);
+	struct dfa *dfa;
+
+	if ((s.keywords = tok_keywords_new(s.tokens, NUM_TOKENS)) == NULL)
+		return 1;
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "Cannot create %s\n", dir);
+		return 1;
+	}
+	s.dfa = dfa = tok_compile(s.tokens, NUM_TOKENS, s.keywords, NULL);
+
+	test_compile(&s);
+	test_glushkov(&s);
+	test_keywords(&s);
+	test_lazy(&s);
+	test_dfa_file(&s);
+	test_inputs(&s);
+	test_store_file(&s);
+	test_cache(&s);
+	test_parallel(&s);
+	test_relex(&s);
+
+	dfa_free(dfa);
+	nfa_arena_free(arena);
+	rmdir(dir);
+	if (failures > 0) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}